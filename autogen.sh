@@ -1,6 +1,5 @@
 #!/bin/sh
 set -eu
 
-aclocal
-automake --add-missing
-autoconf
+# libtoolize provides ltmain.sh for LT_INIT
+autoreconf -fi
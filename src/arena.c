@@ -0,0 +1,130 @@
+
+/*
+ * arena.c
+ *
+ *  Region allocator
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "arena.h"
+
+#define ARENA_ALIGN 16
+
+struct arena_chunk
+{
+  struct arena_chunk* next;
+  size_t size;
+  size_t used;
+  char data[] __attribute__ ((aligned (ARENA_ALIGN)));
+};
+
+static inline size_t
+round_up(size_t n)
+{
+  return (n + ARENA_ALIGN - 1) & ~((size_t) ARENA_ALIGN - 1);
+}
+
+void
+arena_init(arena* A, size_t chunk_size)
+{
+  A->head = NULL;
+  A->chunk_size = chunk_size;
+  A->last = NULL;
+}
+
+static bool
+chunk_push(arena* A, size_t n)
+{
+  // Large allocations get a chunk of their own
+  size_t size = n > A->chunk_size/2 ? n : A->chunk_size;
+  struct arena_chunk* c = malloc(sizeof(struct arena_chunk) + size);
+  if (c == NULL) return false;
+  c->next = A->head;
+  c->size = size;
+  c->used = 0;
+  A->head = c;
+  return true;
+}
+
+void*
+arena_alloc(arena* A, size_t n)
+{
+  n = round_up(n == 0 ? 1 : n);
+  if (A->head == NULL || A->head->used + n > A->head->size)
+    if (!chunk_push(A, n))
+      return NULL;
+  void* result = A->head->data + A->head->used;
+  A->head->used += n;
+  A->last = result;
+  return result;
+}
+
+void*
+arena_calloc(arena* A, size_t n)
+{
+  void* result = arena_alloc(A, n);
+  if (result != NULL)
+    memset(result, 0, n);
+  return result;
+}
+
+void*
+arena_grow(arena* A, void* p, size_t old, size_t n)
+{
+  if (p == NULL)
+    return arena_alloc(A, n);
+  if (p == A->last)
+  {
+    struct arena_chunk* c = A->head;
+    size_t start = (char*) p - c->data;
+    if (start + round_up(n) <= c->size)
+    {
+      c->used = start + round_up(n);
+      return p;
+    }
+  }
+  void* result = arena_alloc(A, n);
+  if (result != NULL)
+    memcpy(result, p, old < n ? old : n);
+  return result;
+}
+
+char*
+arena_strdup(arena* A, const char* s)
+{
+  size_t n = strlen(s) + 1;
+  char* result = arena_alloc(A, n);
+  if (result != NULL)
+    memcpy(result, s, n);
+  return result;
+}
+
+arena_mark
+arena_save(arena* A)
+{
+  arena_mark mark = { A->head, A->head == NULL ? 0 : A->head->used };
+  return mark;
+}
+
+void
+arena_restore(arena* A, arena_mark mark)
+{
+  while (A->head != mark.head)
+  {
+    struct arena_chunk* c = A->head;
+    A->head = c->next;
+    free(c);
+  }
+  if (A->head != NULL)
+    A->head->used = mark.used;
+  A->last = NULL;
+}
+
+void
+arena_finalize(arena* A)
+{
+  arena_mark start = { NULL, 0 };
+  arena_restore(A, start);
+}
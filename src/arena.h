@@ -0,0 +1,54 @@
+
+/*
+ * arena.h
+ *
+ *  Region allocator: many small allocations, freed all at once
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+
+struct arena_chunk;
+
+typedef struct
+{
+  /** The current chunk: older chunks follow it */
+  struct arena_chunk* head;
+  size_t chunk_size;
+  /** The last allocation, which may be grown in place */
+  void* last;
+} arena;
+
+/** A point to which the arena may be rolled back */
+typedef struct
+{
+  struct arena_chunk* head;
+  size_t used;
+} arena_mark;
+
+void arena_init(arena* A, size_t chunk_size);
+
+/** @return Aligned memory, or NULL on failure */
+void* arena_alloc(arena* A, size_t n);
+
+/** @return Zeroed memory, or NULL on failure */
+void* arena_calloc(arena* A, size_t n);
+
+/**
+   Resize p from old to n bytes: in place if it was the last
+   allocation and there is room, else by copying
+   @return The new location, or NULL on failure
+*/
+void* arena_grow(arena* A, void* p, size_t old, size_t n);
+
+char* arena_strdup(arena* A, const char* s);
+
+arena_mark arena_save(arena* A);
+
+/** Release everything allocated since the mark was saved */
+void arena_restore(arena* A, arena_mark mark);
+
+/** Release all memory */
+void arena_finalize(arena* A);
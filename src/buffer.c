@@ -14,6 +14,7 @@ buffer_init(buffer* B, size_t capacity)
   B->data = malloc(capacity);
   if (B->data == NULL)
     return false;
+  B->data[0] = '\0';
   B->length = 0;
   B->capacity = capacity;
   return true;
@@ -22,6 +23,7 @@ buffer_init(buffer* B, size_t capacity)
 void
 buffer_reset(buffer* B)
 {
+  B->data[0] = '\0';
   B->length = 0;
 }
 
@@ -68,18 +70,22 @@ buffer_appendv(buffer* B, const char* format, ...)
 bool
 buffer_append_data(buffer* B, const char* data, int count)
 {
-  if (B->length + count > B->capacity)
+  // Leave room for the terminating NUL
+  if (B->length + count + 1 > B->capacity)
   {
     size_t c2 = B->capacity * 2;
+    while (B->length + count + 1 > c2)
+      c2 *= 2;
     // printf("realloc: %zi -> %zi\n", b->capacity, c2);
-    B->capacity = c2;
     char* new = realloc(B->data, c2);
     if (new == NULL)
       return false;
     B->data = new;
+    B->capacity = c2;
   }
   char* tail = B->data + B->length;
-  strcpy(tail, data);
+  memcpy(tail, data, count);
+  tail[count] = '\0';
   B->length += count;
   return true;
 }
@@ -0,0 +1,299 @@
+/*
+ * libstash.c
+ *
+ *  The commands keep their state in thread-local variables:
+ *  each call sets them from its context, runs the command,
+ *  and restores the caller's, so calls may nest.
+ *  stash_abort() jumps back to the call instead of exiting.
+ */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE // for fopencookie()
+#endif
+
+#include <setjmp.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "buffer.h"
+#include "libstash.h"
+#include "stash.h"
+#include "stash_file.h"
+#include "stash_log.h"
+#include "stash_patch.h"
+#include "stash_pool.h"
+#include "stash_wc.h"
+
+struct stash_ctx
+{
+  stash_log_fn log;
+  void* log_data;
+  stash_prompt_fn prompt;
+  void* prompt_data;
+  int verbosity;
+  int fuzz;
+  int jobs;
+  bool fsync;
+  /** Output not yet passed to log: less than a line */
+  buffer partial;
+  char error[STASH_ERROR_MAX];
+};
+
+/** The calling thread's state, while a call runs */
+typedef struct
+{
+  FILE* output;
+  /** The stream to the log function, if any */
+  FILE* log;
+  stash_log_level verbosity;
+  int fuzz;
+  int jobs;
+  bool fsync;
+  stash_prompt_function prompt;
+  void* prompt_data;
+  jmp_buf* jump;
+  arena_mark mark;
+  char error[STASH_ERROR_MAX];
+} thread_state;
+
+stash_ctx*
+stash_ctx_new()
+{
+  stash_ctx* ctx = calloc(1, sizeof(stash_ctx));
+  if (ctx == NULL) return NULL;
+  ctx->verbosity = STASH_INFO;
+  ctx->fuzz = 2;
+  if (!buffer_init(&ctx->partial, 256))
+  {
+    free(ctx);
+    return NULL;
+  }
+  return ctx;
+}
+
+void
+stash_ctx_set_log(stash_ctx* ctx, stash_log_fn fn, void* data)
+{
+  ctx->log = fn;
+  ctx->log_data = data;
+}
+
+void
+stash_ctx_set_prompt(stash_ctx* ctx, stash_prompt_fn fn, void* data)
+{
+  ctx->prompt = fn;
+  ctx->prompt_data = data;
+}
+
+void
+stash_ctx_set_verbosity(stash_ctx* ctx, int level)
+{
+  ctx->verbosity = level;
+}
+
+void
+stash_ctx_set_fuzz(stash_ctx* ctx, int fuzz)
+{
+  ctx->fuzz = fuzz;
+}
+
+void
+stash_ctx_set_jobs(stash_ctx* ctx, int jobs)
+{
+  ctx->jobs = jobs;
+}
+
+void
+stash_ctx_set_fsync(stash_ctx* ctx, bool fsync)
+{
+  ctx->fsync = fsync;
+}
+
+/** Pass each complete line to the log function */
+static ssize_t
+log_write(void* cookie, const char* data, size_t length)
+{
+  stash_ctx* ctx = cookie;
+  if (!buffer_append_data(&ctx->partial, data, (int) length))
+    return -1;
+  char* p = ctx->partial.data;
+  char* end = p + ctx->partial.length;
+  char* q;
+  while ((q = memchr(p, '\n', (size_t)(end-p))) != NULL)
+  {
+    *q = '\0';
+    ctx->log(ctx->log_data, p);
+    p = q+1;
+  }
+  size_t rest = (size_t)(end-p);
+  memmove(ctx->partial.data, p, rest);
+  ctx->partial.length = rest;
+  return (ssize_t) length;
+}
+
+static int
+log_close(void* cookie)
+{
+  stash_ctx* ctx = cookie;
+  if (ctx->partial.length > 0)
+  {
+    buffer_append_data(&ctx->partial, "", 1);
+    ctx->log(ctx->log_data, ctx->partial.data);
+  }
+  ctx->partial.length = 0;
+  return 0;
+}
+
+static void
+enter(stash_ctx* ctx, thread_state* T)
+{
+  // A thread that did not run stash_init()
+  if (stash_arena.chunk_size == 0)
+    arena_init(&stash_arena, 256*1024);
+  T->output      = stash_log_output;
+  T->verbosity   = stash_verbosity;
+  T->fuzz        = stash_patch_fuzz;
+  T->jobs        = stash_pool_jobs;
+  T->fsync       = stash_file_fsync;
+  T->prompt      = stash_prompt;
+  T->prompt_data = stash_prompt_data;
+  T->jump        = stash_abort_jump;
+  T->mark        = arena_save(&stash_arena);
+  strcpy(T->error, stash_error);
+
+  T->log = NULL;
+  if (ctx->log != NULL)
+  {
+    cookie_io_functions_t io = { NULL, log_write, NULL, log_close };
+    // Else the messages go to the caller's output
+    T->log = fopencookie(ctx, "w", io);
+    if (T->log != NULL)
+    {
+      setvbuf(T->log, NULL, _IOLBF, 0);
+      stash_log_output = T->log;
+    }
+  }
+  stash_verbosity   = ctx->verbosity;
+  stash_patch_fuzz  = ctx->fuzz;
+  stash_pool_jobs   = ctx->jobs;
+  stash_file_fsync  = ctx->fsync;
+  stash_prompt      = ctx->prompt;
+  stash_prompt_data = ctx->prompt_data;
+  stash_error[0]    = '\0';
+  ctx->error[0]     = '\0';
+}
+
+static void
+leave(stash_ctx* ctx, thread_state* T, stash_status status)
+{
+  if (status != STASH_OK)
+    strcpy(ctx->error, stash_error[0] != '\0' ?
+                       stash_error : stash_status_string(status));
+  if (T->log != NULL)
+    fclose(T->log);
+  stash_log_output  = T->output;
+  stash_verbosity   = T->verbosity;
+  stash_patch_fuzz  = T->fuzz;
+  stash_pool_jobs   = T->jobs;
+  stash_file_fsync  = T->fsync;
+  stash_prompt      = T->prompt;
+  stash_prompt_data = T->prompt_data;
+  stash_abort_jump  = T->jump;
+  arena_restore(&stash_arena, T->mark);
+  strcpy(stash_error, T->error);
+}
+
+typedef bool (*operation)(const char* arg1, const char* arg2);
+
+static stash_status
+call(stash_ctx* ctx, operation op, const char* arg1, const char* arg2)
+{
+  thread_state T;
+  enter(ctx, &T);
+  jmp_buf jump;
+  volatile stash_status status = STASH_ABORTED;
+  if (setjmp(jump) == 0)
+  {
+    stash_abort_jump = &jump;
+    status = op(arg1, arg2) ? STASH_OK : STASH_FAILED;
+  }
+  leave(ctx, &T, status);
+  return status;
+}
+
+static stash_status
+invalid(stash_ctx* ctx, const char* message)
+{
+  strcpy(ctx->error, message);
+  return STASH_INVALID;
+}
+
+stash_status
+stash_ctx_push(stash_ctx* ctx, const char* file, const char* hunks)
+{
+  if (file == NULL) return invalid(ctx, "provide a file!");
+  return call(ctx, stash_push, file, hunks);
+}
+
+stash_status
+stash_ctx_pop(stash_ctx* ctx, const char* file, const char* hunks)
+{
+  if (file == NULL) return invalid(ctx, "provide a file!");
+  return call(ctx, stash_pop, file, hunks);
+}
+
+stash_status
+stash_ctx_push_tree(stash_ctx* ctx, const char* dir,
+                    const char* changelist)
+{
+  return call(ctx, stash_push_tree, dir, changelist);
+}
+
+stash_status
+stash_ctx_pop_tree(stash_ctx* ctx, const char* dir,
+                   const char* changelist)
+{
+  return call(ctx, stash_pop_tree, dir, changelist);
+}
+
+stash_status
+stash_ctx_list(stash_ctx* ctx, const char* file, const char* format)
+{
+  if (file == NULL) return invalid(ctx, "provide a file!");
+  return call(ctx, stash_list, file, format);
+}
+
+stash_status
+stash_ctx_list_tree(stash_ctx* ctx, const char* dir, const char* format)
+{
+  return call(ctx, stash_list_tree, dir, format);
+}
+
+const char*
+stash_ctx_error(const stash_ctx* ctx)
+{
+  return ctx->error;
+}
+
+const char*
+stash_status_string(stash_status status)
+{
+  switch (status)
+  {
+    case STASH_OK:      return "ok";
+    case STASH_FAILED:  return "failed";
+    case STASH_INVALID: return "invalid argument";
+    case STASH_ABORTED: return "aborted";
+  }
+  return "unknown";
+}
+
+void
+stash_ctx_free(stash_ctx* ctx)
+{
+  if (ctx == NULL) return;
+  stash_wc_close();
+  buffer_finalize(&ctx->partial);
+  free(ctx);
+}
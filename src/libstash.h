@@ -0,0 +1,134 @@
+/*
+ * libstash.h
+ *
+ *  The stash library: push and pop hunks in-process.
+ *  bin/stash is a command line over this.
+ *
+ *  A context holds the settings, callbacks and error of its calls.
+ *  A context is used by one thread at a time, but each thread may
+ *  have its own context, and run calls at the same time as the
+ *  others, as long as no two calls work on the same file.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct stash_ctx stash_ctx;
+
+typedef enum
+{
+  STASH_OK = 0,
+  /** The operation failed: see stash_ctx_error() */
+  STASH_FAILED,
+  /** A bad argument, e.g., no file */
+  STASH_INVALID,
+  /** An internal error, e.g., out of memory: the call may have
+      leaked memory and file descriptors */
+  STASH_ABORTED
+} stash_status;
+
+/**
+   Receives the messages of the calls, one line at a time,
+   without the newline.  In tree calls, it is called from
+   worker threads, but never by two threads at once.
+*/
+typedef void (*stash_log_fn)(void* data, const char* line);
+
+/**
+   Asks what to do with a hunk in interactive mode
+   number: The hunk number, from 1
+   hunk: The text of the hunk, not NUL-terminated
+   choices: The keys that may be returned:
+            "sdkq" to push: save, drop, skip or quit,
+            "pdkq" to pop: pop, drop, skip or quit
+   @return One of choices: anything else means quit
+*/
+typedef int (*stash_prompt_fn)(void* data, int number,
+                               const char* hunk, size_t length,
+                               const char* choices);
+
+/** @return NULL if out of memory */
+stash_ctx* stash_ctx_new(void);
+
+/**
+   Messages go to fn, or if it is NULL (the default),
+   to standard output
+*/
+void stash_ctx_set_log(stash_ctx* ctx, stash_log_fn fn, void* data);
+
+/**
+   Interactive mode asks fn, or if it is NULL (the default),
+   the terminal
+*/
+void stash_ctx_set_prompt(stash_ctx* ctx, stash_prompt_fn fn,
+                          void* data);
+
+/** From 1 (errors only) to 5 (trace): default 3 (info) */
+void stash_ctx_set_verbosity(stash_ctx* ctx, int level);
+
+/** Fuzz factor for applying hunks: default 2, like patch */
+void stash_ctx_set_fuzz(stash_ctx* ctx, int fuzz);
+
+/** Files worked on at once by tree calls: default 0, one per core */
+void stash_ctx_set_jobs(stash_ctx* ctx, int jobs);
+
+/** Sync each file to disk before renaming it into place */
+void stash_ctx_set_fsync(stash_ctx* ctx, bool fsync);
+
+/**
+   Push hunks from the file to its stash
+   hunks: A hunk list as on the command line, e.g., "1,3-5" or "@",
+          or NULL for interactive mode
+*/
+stash_status stash_ctx_push(stash_ctx* ctx, const char* file,
+                            const char* hunks);
+
+/** Pop hunks from the stash of the file: as stash_ctx_push() */
+stash_status stash_ctx_pop(stash_ctx* ctx, const char* file,
+                           const char* hunks);
+
+/**
+   Push all hunks of the modified files under dir,
+   or of the files in the changelist
+   dir, changelist: Either may be NULL
+*/
+stash_status stash_ctx_push_tree(stash_ctx* ctx, const char* dir,
+                                 const char* changelist);
+
+/** Pop all stashes under dir, or of the files in the changelist */
+stash_status stash_ctx_pop_tree(stash_ctx* ctx, const char* dir,
+                                const char* changelist);
+
+/**
+   Print the hunks in the stash of the file, from its index,
+   one line per hunk (TSV) or per file (JSON) through the log:
+   number, "@@" ranges, lines added and removed, bytes and checksum
+   format: "tsv" (NULL) or "json"
+*/
+stash_status stash_ctx_list(stash_ctx* ctx, const char* file,
+                            const char* format);
+
+/** List all stashes under dir, or NULL for ".", as stash_ctx_list() */
+stash_status stash_ctx_list_tree(stash_ctx* ctx, const char* dir,
+                                 const char* format);
+
+/**
+   @return The first error of the last call that failed,
+           or "" if it succeeded: valid until the next call
+*/
+const char* stash_ctx_error(const stash_ctx* ctx);
+
+const char* stash_status_string(stash_status status);
+
+/** Also closes the calling thread's working copy database */
+void stash_ctx_free(stash_ctx* ctx);
+
+#ifdef __cplusplus
+}
+#endif
@@ -1,20 +1,69 @@
 
+#include <errno.h>
+#include <getopt.h>
+#include <limits.h>
+#include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 
+#include "libstash.h"
 #include "stash.h"
 
+#include "stash_batch.h"
 #include "stash_log.h"
+#include "stash_serve.h"
 
-static void get_flags(int argc, char* argv[]);
+static int run(int argc, char* argv[]);
+
+static bool get_flags(int argc, char* argv[], bool* exit_now);
+
+/** Tree mode: -r DIR and/or --changelist NAME */
+static bool  tree       = false;
+static char* tree_dir   = NULL;
+static char* changelist = NULL;
+
+/** --socket: send the command to stash serve */
+static char* socket_name = NULL;
+
+/** True in stash serve: commands come from clients */
+static bool serving = false;
+
+/** --batch: run the commands in a file, or standard input */
+static bool batch = false;
+
+/** True in --batch: commands come from the batch */
+static bool batching = false;
+
+/** Why the last command failed, for --batch */
+static char run_error[STASH_ERROR_MAX];
+
+/** list --json */
+static bool json = false;
+
+/** -v/-q, -F, -j, --fsync */
+static int  verbosity;
+static int  fuzz;
+static int  jobs;
+static bool fsync_files;
+
+static stash_ctx* ctx = NULL;
+
+static int run_batch(const char* input_name);
 
 static void help(void);
 
+static int fail(const char* format, ...)
+  __attribute__ ((format (printf, 1, 2)));
+
 int
 main(int argc, char* argv[])
 {
   stash_init();
+  ctx = stash_ctx_new();
+  if (ctx == NULL)
+    stash_abort("Failed to allocate memory!");
 
   if (argc == 1)
   {
@@ -22,92 +71,344 @@ main(int argc, char* argv[])
     return 0;
   }
 
-  get_flags(argc, argv);
+  int status = run(argc, argv);
+  stash_ctx_free(ctx);
+  stash_finalize();
+  return status;
+}
+
+/**
+   Run one command: from main(), or in stash serve or --batch,
+   where flags start at their defaults for each command
+   @return The exit status
+*/
+static int
+run(int argc, char* argv[])
+{
+  tree        = false;
+  tree_dir    = NULL;
+  changelist  = NULL;
+  socket_name = NULL;
+  batch       = false;
+  json        = false;
+  verbosity   = STASH_INFO;
+  fuzz        = 2;
+  jobs        = 0;
+  fsync_files = false;
+  run_error[0] = '\0';
+
+  bool exit_now = false;
+  if (!get_flags(argc, argv, &exit_now))
+    return EXIT_FAILURE;
+  if (exit_now)
+    return EXIT_SUCCESS;
+  // For stash serve, and for the messages here
+  stash_verbosity = verbosity;
+  stash_ctx_set_verbosity(ctx, verbosity);
+  stash_ctx_set_fuzz(ctx, fuzz);
+  stash_ctx_set_jobs(ctx, jobs);
+  stash_ctx_set_fsync(ctx, fsync_files);
 
-  if (optind + 2 > argc)
+  if (batch)
   {
-    help();
-    printf("\n");
-    stash_abort("provide more arguments!\n");
+    if (serving || batching)
+      return fail("--batch cannot be run from a batch or a server");
+    if (argc > optind+1)
+      return fail("--batch takes at most one file");
+    return run_batch(optind < argc ? argv[optind] : "-");
   }
 
-  char* subcmd_text = argv[optind];
   stash_subcmd subcmd;
-  bool rc;
-  rc = stash_subcmd_lookup(subcmd_text, &subcmd);
-  if (!rc) stash_abort("No such subcommand: %s", subcmd_text);
+  bool rc = false;
+  if (optind < argc)
+  {
+    rc = stash_subcmd_lookup(argv[optind], &subcmd);
+    if (!rc) return fail("No such subcommand: %s", argv[optind]);
+  }
+
+  if (rc && subcmd == STASH_SUBCMD_LIST)
+  {
+    if (changelist != NULL)
+      return fail("list takes -r DIR, not --changelist");
+    if (argc > optind+2)
+      return fail("list takes no hunks");
+  }
+
+  // In tree mode, and for serve, only the subcommand is required
+  int required = (tree || (rc && subcmd == STASH_SUBCMD_SERVE)) ? 1 : 2;
+  if (optind + required > argc)
+  {
+    help();
+    stash_print("\n");
+    return fail("provide more arguments!\n");
+  }
+
+  if (subcmd == STASH_SUBCMD_SERVE)
+  {
+    if (serving) return fail("already serving");
+    if (batching) return fail("--batch cannot serve");
+    char default_socket[path_max];
+    if (socket_name == NULL)
+    {
+      stash_serve_default_socket(default_socket);
+      socket_name = default_socket;
+    }
+    serving = true;
+    rc = stash_serve(socket_name, run);
+    serving = false;
+    return rc ? EXIT_SUCCESS : EXIT_FAILURE;
+  }
+
+  // A batch runs its commands here: it has its own cache
+  if (socket_name != NULL && !serving && !batching)
+  {
+    int status = stash_serve_request(socket_name, argc-1, argv+1);
+    if (status >= 0) return status;
+    // No server: run the command here
+  }
+
+  stash_status status = STASH_INVALID;
+  if (tree)
+  {
+    if (argc > optind+1)
+      return fail("-r and --changelist take no file or hunks");
+    if (subcmd == STASH_SUBCMD_PUSH)
+      status = stash_ctx_push_tree(ctx, tree_dir, changelist);
+    else if (subcmd == STASH_SUBCMD_POP)
+      status = stash_ctx_pop_tree(ctx, tree_dir, changelist);
+    else if (subcmd == STASH_SUBCMD_LIST)
+      status = stash_ctx_list_tree(ctx, tree_dir, json ? "json" : "tsv");
+    if (status != STASH_OK)
+      strcpy(run_error, stash_ctx_error(ctx));
+    return status == STASH_OK ? EXIT_SUCCESS : EXIT_FAILURE;
+  }
 
   char* text_file = argv[optind+1];
 
+  if (subcmd == STASH_SUBCMD_LIST)
+  {
+    status = stash_ctx_list(ctx, text_file, json ? "json" : "tsv");
+    if (status != STASH_OK)
+      strcpy(run_error, stash_ctx_error(ctx));
+    return status == STASH_OK ? EXIT_SUCCESS : EXIT_FAILURE;
+  }
+
   char* hunks = NULL;
   if (argc > optind+2)
     hunks = argv[optind+2];
-
-  rc = stash_init_tmp();
-  if (!rc) stash_abort("could not initialize");
+  if (hunks == NULL && serving)
+    return fail("stash serve cannot prompt: give the hunks");
+  if (hunks == NULL && batching)
+    return fail("--batch cannot prompt: give the hunks");
 
   if (subcmd == STASH_SUBCMD_PUSH)
-    rc = stash_push(text_file, hunks);
+    status = stash_ctx_push(ctx, text_file, hunks);
   else if (subcmd == STASH_SUBCMD_POP)
-    rc = stash_pop(text_file, hunks);
+    status = stash_ctx_pop(ctx, text_file, hunks);
 
-  if (!rc) return EXIT_FAILURE;
-  return EXIT_SUCCESS;
+  if (status != STASH_OK)
+    strcpy(run_error, stash_ctx_error(ctx));
+  return status == STASH_OK ? EXIT_SUCCESS : EXIT_FAILURE;
 }
 
-static void unknown_argument(char c);
+/** Run one command of a batch */
+static int
+batch_command(int argc, char* argv[], const char** error)
+{
+  int status = run(argc, argv);
+  *error = run_error;
+  return status;
+}
 
-static void
-get_flags(int argc, char* argv[])
+/**
+   Run the commands in the file, or if it is "-", standard input.
+   Their messages go to standard error, the results to output.
+*/
+static int
+run_batch(const char* input_name)
+{
+  FILE* input = stdin;
+  if (strcmp(input_name, "-") != 0)
+  {
+    input = fopen(input_name, "r");
+    if (input == NULL)
+      return fail("could not read: %s", input_name);
+  }
+  FILE* output = stdout;
+  stash_log_output = stderr;
+  batching = true;
+  bool rc = stash_batch(input, output, batch_command);
+  batching = false;
+  stash_log_output = NULL;
+  if (input != stdin)
+    fclose(input);
+  return rc ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+/** Report an error in the command line, like stash_abort() */
+static int
+fail(const char* format, ...)
+{
+  char buffer[1024];
+  va_list ap;
+  va_start(ap, format);
+  vsnprintf(buffer, sizeof(buffer), format, ap);
+  va_end(ap);
+  stash_print("stash: abort: %s\n", buffer);
+  strcpy(run_error, buffer);
+  return EXIT_FAILURE;
+}
+
+static bool unknown_argument(char c);
+
+/** Long options with no short form */
+enum { FLAG_BATCH = 256, FLAG_CHANGELIST, FLAG_FSYNC, FLAG_JSON,
+       FLAG_SOCKET };
+
+static struct option long_options[] =
+{
+  { "batch",      no_argument,       NULL, FLAG_BATCH },
+  { "changelist", required_argument, NULL, FLAG_CHANGELIST },
+  { "fsync",      no_argument,       NULL, FLAG_FSYNC },
+  { "json",       no_argument,       NULL, FLAG_JSON },
+  { "socket",     required_argument, NULL, FLAG_SOCKET },
+  { NULL,         0,                 NULL, 0 }
+};
+
+/**
+   Parse a whole decimal number for a flag
+   @return False on junk, overflow, or less than minimum
+*/
+static bool
+parse_int(const char* s, int minimum, int* output)
 {
+  char* end;
+  errno = 0;
+  long v = strtol(s, &end, 10);
+  if (errno != 0 || end == s || *end != '\0' ||
+      v < minimum || v > INT_MAX)
+    return false;
+  *output = (int) v;
+  return true;
+}
+
+/**
+   exit_now: OUT: True if there is nothing more to do (-h)
+   @return False on a bad flag
+*/
+static bool
+get_flags(int argc, char* argv[], bool* exit_now)
+{
+  // Start over: stash serve parses many command lines
+  optind = 0;
   while (true)
   {
-    int c = getopt(argc, argv, ":hqv");
+    int c = getopt_long(argc, argv, ":F:hj:qr:v", long_options, NULL);
     if (c == -1) break;
     switch (c)
     {
+      case FLAG_BATCH:
+        batch = true;
+        break;
+      case FLAG_CHANGELIST:
+        changelist = optarg;
+        tree = true;
+        break;
+      case FLAG_FSYNC:
+        fsync_files = true;
+        break;
+      case FLAG_JSON:
+        json = true;
+        break;
+      case FLAG_SOCKET:
+        socket_name = optarg;
+        break;
+      case 'F':
+        if (!parse_int(optarg, 0, &fuzz))
+        {
+          fail("bad fuzz factor: %s", optarg);
+          return false;
+        }
+        break;
       case 'h':
         help();
-        exit(EXIT_SUCCESS);
+        *exit_now = true;
+        return true;
+      case 'j':
+        if (!parse_int(optarg, 1, &jobs))
+        {
+          fail("bad number of jobs: %s", optarg);
+          return false;
+        }
         break;
       case 'q':
-        stash_verbosity--;
+        verbosity--;
+        break;
+      case 'r':
+        tree_dir = optarg;
+        tree = true;
         break;
       case 'v':
-        stash_verbosity++;
+        verbosity++;
         break;
+      case ':':
+        fail("flag requires an argument: '%c'", optopt);
+        return false;
       case '?':
-        unknown_argument(optopt);
-        break;
+        return unknown_argument(optopt);
     }
   }
+  return true;
 }
 
-static void
+static bool
 unknown_argument(char c)
 {
-  printf("stash: unknown flag: '%c'\n", c);
+  stash_print("stash: unknown flag: '%c'\n", c);
+  sprintf(run_error, "unknown flag: '%c'", c);
   help();
-  exit(EXIT_FAILURE);
+  return false;
 }
 
 #define NL "\n"
 
 static char* help_string =
 "stash: usage:" NL NL
-"  stash push|pop <flags> <file> <hunks>?" NL NL
+"  stash push|pop <flags> <file> <hunks>?" NL
+"  stash push|pop <flags> -r <dir>" NL
+"  stash push|pop <flags> --changelist <name>" NL
+"  stash list|show <flags> <file>" NL
+"  stash list|show <flags> -r <dir>" NL
+"  stash serve <flags>" NL
+"  stash --batch <flags> <file>?" NL NL
 "  where hunks is" NL
 "  * nothing -> interactive mode" NL
-"  * a comma-separated list of integers" NL
+"  * a comma-separated list of integers, ranges N-M or N-," NL
+"    or any of these after '^' to leave them out" NL
 "  * '@' -> all hunks" NL NL
 "flags:" NL
+"  --batch : run the commands in file, or standard input, one per" NL
+"            line, e.g., 'push file.c 1,3-5', writing one result" NL
+"            per command: line number, ok or failed, and error" NL
+"  -F N : fuzz factor for applying hunks (default 2, like patch)" NL
 "  -h : help" NL
+"  -j N : with -r or --changelist, work on N files at once" NL
+"         (default: the number of cores)" NL
 "  -q : decrease verbosity (may be given several times)" NL
+"  -r DIR : push all hunks of all files under DIR," NL
+"           or pop all stashes under DIR" NL
+"  --changelist NAME : push or pop all hunks of the files" NL
+"                      in changelist NAME (under -r DIR if given)" NL
+"  --fsync : sync each file to disk before renaming it into place" NL
+"  --json : list hunks as JSON, one line per file (default: TSV)" NL
+"  --socket PATH : send the command to stash serve on PATH," NL
+"                  or with serve, listen on PATH" NL
+"                  (default for serve: $XDG_RUNTIME_DIR/stash.sock)" NL
 "  -v : increase verbosity (may be given several times)" NL
 ;
 
 static void
 help()
 {
-  printf("%s", help_string);
+  stash_print("%s", help_string);
 }
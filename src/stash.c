@@ -1,82 +1,90 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE // for nftw() actions
+#endif
+
 
 #include <assert.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <ftw.h>
 #include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 #include <sys/stat.h>
 
 #include "buffer.h"
 #include "stash.h"
+#include "stash_base.h"
+#include "stash_cache.h"
+#include "stash_diff.h"
+#include "stash_diff_cache.h"
+#include "stash_hunks.h"
+#include "stash_image.h"
+#include "stash_index.h"
 #include "stash_log.h"
+#include "stash_patch.h"
+#include "stash_pool.h"
+#include "stash_sched.h"
+#include "stash_select.h"
+#include "stash_wc.h"
 #include "util.h"
 
-/** Used for reading lines of text */
-#define MAX_LINE 1024
+__thread arena stash_arena;
+
+__thread jmp_buf* stash_abort_jump = NULL;
 
-/** Used for temp files */
-static char tmp_name_template[path_max];
-static int  tmp_name_suffix_length;
+__thread stash_prompt_function stash_prompt = NULL;
+__thread void* stash_prompt_data = NULL;
 
 bool
 stash_init()
 {
   stash_verbosity = STASH_INFO;
+  arena_init(&stash_arena, 256*1024);
   return true;
 }
 
-bool
-stash_init_tmp()
-{
-  char  buffer[path_max];
-  char* tmpdir;
-  if (! (getenv_string("STASH_TMP", &tmpdir) ||
-         getenv_string("TMPDIR", &tmpdir)))
-  {
-    char* user = getenv("USER");
-    sprintf(buffer, "/tmp/%s/stash", user);
-    tmpdir = &buffer[0];
-  }
-  stash_log(STASH_DEBUG, "tmpdir: %s", tmpdir);
-  bool b = mkdirp(tmpdir);
-  CHECK(b, "could not make tmpdir: %s", tmpdir);
-  char* suffix = ".txt";
-  tmp_name_suffix_length = strlen(suffix);
-  sprintf(tmp_name_template, "%s/stash.XXXXXX%s", tmpdir, suffix);
-  return true;
-}
-
-static void
-stash_temp_file(stash_file* file, const char* label)
+void
+stash_finalize()
 {
-  stash_make_temp(file, label,
-                  tmp_name_template, tmp_name_suffix_length);
-  stash_log(STASH_DEBUG, "temp file: [%s] %s", label, file->name);
+  stash_wc_close();
+  arena_finalize(&stash_arena);
 }
 
-static void
-stash_temp_file_fopen(stash_file* file, const char* label)
+void*
+stash_alloc(size_t n)
 {
-  stash_temp_file(file, label);
-  stash_file_fdopen(file, "r+");
+  void* result = arena_calloc(&stash_arena, n);
+  if (result == NULL)
+    stash_abort("Failed to allocate memory!");
+  return result;
 }
 
-/*
-static void
-cat(const char* filename)
+void*
+stash_grow(void* p, size_t old, size_t n)
 {
-  char cmd[path_max*3];
-  sprintf(cmd, "cat %s", filename);
-  stash_log(STASH_INFO, cmd);
-  system(cmd);
+  void* result = arena_grow(&stash_arena, p, old, n);
+  if (result == NULL)
+    stash_abort("Failed to allocate memory!");
+  return result;
 }
-*/
 
 bool
 stash_subcmd_lookup(const char* text, stash_subcmd* subcmd)
 {
+  if (strcmp(text, "serve") == 0)
+  {
+    *subcmd = STASH_SUBCMD_SERVE;
+    return true;
+  }
+  if (strcmp(text, "list") == 0 || strcmp(text, "show") == 0)
+  {
+    *subcmd = STASH_SUBCMD_LIST;
+    return true;
+  }
   if (strlen(text) < 2)
     return false;
   if (text[0] != 'p')
@@ -90,22 +98,30 @@ stash_subcmd_lookup(const char* text, stash_subcmd* subcmd)
   return true;
 }
 
-static bool hunk_ids_contains(int index, struct list* hunk_ids);
-static bool stash_push_hunks(struct list* hunks,
-                             struct list* hunk_ids,
+static bool stash_push_hunks(stash_hunks* hunks,
+                             stash_select* select,
                              const char* stash_name);
-static bool stash_resolve(struct list* hunks, struct list* hunk_ids,
-                          const char* text_name);
+static bool stash_preflight(stash_hunks* hunks, stash_select* select,
+                            stash_patch* patch, bool reverse,
+                            const char* action);
+static void stash_unpush(const char* stash_name, off_t size);
+
+bool stash_make_diff(const char* changelist, const char* path,
+                     stash_hunks* hunks);
+static bool stash_find_hunks(const char* text_name,
+                             stash_hunks* hunks, stash_base* base);
 
-bool stash_parse_diff(stash_file* diff, struct list* hunks);
-bool stash_make_diff(const char* file, stash_file* diff);
+static bool stash_push_hunks_interactive(stash_hunks* hunks,
+                                         const char* text_name);
 
-static bool stash_push_hunks_interactive(struct list* hunks,
-                                         const char* text_name,
-                                         stash_file* diff);
+bool stash_push_ids(stash_hunks* hunks, const char* hunk_ids_s,
+                    const char* text_name, const char* stash_name,
+                    const stash_base* base);
 
-bool stash_push_ids(struct list* hunks, const char* hunk_ids_s,
-                    const char* text_name, const char* stash_name);
+static bool stash_push_select(stash_hunks* hunks, stash_select* select,
+                              const char* text_name,
+                              const char* stash_name,
+                              const stash_base* base);
 
 bool
 stash_push(const char* text_name, const char* hunk_ids_s)
@@ -113,114 +129,192 @@ stash_push(const char* text_name, const char* hunk_ids_s)
   bool result = true;
   CHECK(text_name != NULL, "provide a file!");
 
-  stash_file diff;
-  stash_temp_file_fopen(&diff, "diff");
-
   bool b;
-  b = stash_make_diff(text_name, &diff);
-  CHECK_GOTO(b, done2, "stash push: could not make diff");
+  stash_hunks hunks;
+  stash_hunks_init(&hunks);
+  stash_base base;
+  b = stash_find_hunks(text_name, &hunks, &base);
+  CHECK_GOTO(b, done1, "stash push: could not make diff");
 
   stash_file stash;
   stash_file_init(&stash, "stash");
   stash_filename(text_name, stash.name);
   stash_log(STASH_DEBUG, "the stash file is: %s", stash.name);
-  struct list hunks;
-  list_init(&hunks);
-  stash_parse_diff(&diff, &hunks);
-  if (hunks.size == 0)
+  if (hunks.count == 0)
   {
     stash_log(STASH_INFO, "no changes in %s.", text_name);
     goto done1;
   }
   stash_log(STASH_INFO, "found %i hunk%s",
-            hunks.size, plural(hunks.size));
+            hunks.count, plural(hunks.count));
   if (hunk_ids_s == NULL)
-    b = stash_push_hunks_interactive(&hunks, text_name, &diff);
+    b = stash_push_hunks_interactive(&hunks, text_name);
   else
-    b = stash_push_ids(&hunks, hunk_ids_s, text_name, stash.name);
+    b = stash_push_ids(&hunks, hunk_ids_s, text_name, stash.name,
+                       &base);
 
   CHECK_GOTO(b, done1, "push failed!");
 
   done1:
-  list_destruct(&hunks, NULL);
-  done2:
-  stash_temp_delete(&diff);
+  stash_base_close(&base);
+  stash_hunks_finalize(&hunks);
   return result;
 }
 
-static bool stash_pop_hunks(struct list* hunks, const char* text_name,
-                            stash_file* hunk_file, bool* modified);
+static bool stash_map_stash(stash_hunks* hunks,
+                            const char* stash_name,
+                            const char* hunk_ids_s,
+                            stash_select* select);
+
+static bool stash_pop_hunks(stash_hunks* hunks, stash_select* select,
+                            stash_patch* patch, bool* modified);
 
-static bool stash_pop_hunks_interactive(struct list* hunks,
-                                        const char* text_name,
-                                        stash_file* hunk_file,
+static bool stash_pop_hunks_interactive(stash_hunks* hunks,
+                                        stash_patch* patch,
                                         bool* modified);
 
-static bool stash_overwrite_stash(struct list* hunks,
+static bool stash_overwrite_stash(stash_hunks* hunks,
                                   const char* stash_name);
 
+static bool stash_pop_commit(stash_hunks* hunks, const char* stash_name,
+                             const char* text_name, int previous);
+
 bool
 stash_pop(const char* text_name, const char* hunk_ids_s)
 {
-  struct list hunks;
-  list_init(&hunks);
+  bool result = true;
+  stash_hunks hunks;
+  stash_hunks_init(&hunks);
+
+  stash_select select = { NULL, 0 };
+  int previous = -1;
 
   bool b;
-  stash_file stash;
-  stash_file_init(&stash, "stash");
-  stash_filename(text_name, stash.name);
-  b = stash_file_fopen_r(&stash);
-  CHECK(b, "pop: could not open stash: %s", stash.name);
-  stash_parse_diff(&stash, &hunks);
-  stash_file_close(&stash);
+  char stash_name[path_max];
+  stash_filename(text_name, stash_name);
+  b = stash_map_stash(&hunks, stash_name, hunk_ids_s, &select);
+  CHECK_GOTO(b, done, "pop failed!");
 
-  if (hunks.size == 0)
+  if (hunks.count == 0)
   {
     stash_log(STASH_INFO, "no hunks!");
-    return true;
+    goto done;
   }
-  stash_log(STASH_INFO, "hunks: %i\n", hunks.size);
+  stash_log(STASH_INFO, "hunks: %i\n", hunks.count);
 
-  stash_file hunk;
-  stash_temp_file_fopen(&hunk, "hunk");
-  stash_log(STASH_DEBUG, "hunk file name: %s\n", hunk.name);
+  // The text as it was, to put back if the stash cannot be written
+  previous = open(text_name, O_RDONLY);
+  CHECK_GOTO(previous != -1, done, "pop: could not read: %s", text_name);
+
+  if (hunk_ids_s != NULL && stash_select_full(&select) &&
+      stash_image_restore(text_name, stash_name))
+  {
+    stash_log(STASH_INFO, "popped %i hunk%s to %s (unchanged since push).",
+              hunks.count, plural(hunks.count), text_name);
+    for (int i = 0; i < hunks.count; i++)
+      stash_hunks_remove(&hunks, i);
+    b = stash_pop_commit(&hunks, stash_name, text_name, previous);
+    CHECK_GOTO(b, done, "pop failed!");
+    goto done;
+  }
+
+  stash_patch patch;
+  b = stash_patch_load(&patch, text_name);
+  CHECK_GOTO(b, done, "pop: could not load: %s", text_name);
 
   bool modified;
   if (hunk_ids_s == NULL)
-    stash_pop_hunks_interactive(&hunks, text_name, &hunk, &modified);
-  else
-    stash_pop_hunks(&hunks, text_name, &hunk, &modified);
+    stash_pop_hunks_interactive(&hunks, &patch, &modified);
+  else if (!stash_pop_hunks(&hunks, &select, &patch, &modified))
+  {
+    stash_patch_finalize(&patch);
+    FAIL_GOTO(done, "pop: nothing was changed: %s", text_name);
+  }
 
-  if (modified) stash_overwrite_stash(&hunks, stash.name);
+  // Only drop hunks from the stash once they are in the text
+  b = stash_patch_save(&patch);
+  stash_patch_finalize(&patch);
+  CHECK_GOTO(b, done, "pop: could not write: %s", text_name);
+  if (modified)
+  {
+    b = stash_pop_commit(&hunks, stash_name, text_name, previous);
+    CHECK_GOTO(b, done, "pop failed!");
+  }
 
-  list_destruct(&hunks, NULL);
-  return true;
+  done:
+  if (previous != -1) close(previous);
+  stash_hunks_finalize(&hunks);
+  stash_select_finalize(&select);
+  return result;
 }
 
-static bool stash_pop_hunk(const char* text_name, const char* hunk,
-                           stash_file* hunk_file);
+/** Map the stash and compile the hunk spec against it */
+static bool
+map_select(stash_hunks* hunks, const char* stash_name,
+           const char* hunk_ids_s, stash_select* select)
+{
+  bool b = stash_hunks_map(hunks, stash_name);
+  CHECK(b, "pop: could not open stash: %s", stash_name);
+  if (hunk_ids_s == NULL)
+  {
+    stash_select_all(select, hunks->count);
+    return true;
+  }
+  return stash_select_parse(select, hunk_ids_s, hunks->count);
+}
 
+/**
+   Map the stash, checking the hunks to be popped against the index
+   hunk_ids_s: The hunks to check, or NULL for all of them
+   select: OUT: The compiled hunk_ids_s
+*/
 static bool
-stash_pop_hunks(struct list* hunks, const char* text_name,
-                stash_file* hunk_file, bool* modified)
+stash_map_stash(stash_hunks* hunks, const char* stash_name,
+                const char* hunk_ids_s, stash_select* select)
 {
-  for (int i = 0; i < hunks->size; i++)
+  bool b = map_select(hunks, stash_name, hunk_ids_s, select);
+  if (!b) return false;
+
+  for (int i = 0; i < hunks->count; i++)
   {
-    void* v; // Needed to avoid pointer aliasing
-    list_get(hunks, i, &v);
-    char* hunk = v;
-    bool b;
-    b = stash_pop_hunk(text_name, hunk, hunk_file);
-    CHECK(b, "could not pop hunk!");
-    b = list_remove(hunks, v);
-    assert(b);
-    *modified = true;
+    if (!stash_select_contains(select, i+1))
+      continue;
+    if (!stash_index_verify(hunks, &hunks->hunk[i]))
+    {
+      stash_log(STASH_WARN, "stash index is stale: rebuilding");
+      stash_index_remove(stash_name);
+      stash_hunks_finalize(hunks);
+      stash_select_finalize(select);
+      return map_select(hunks, stash_name, hunk_ids_s, select);
+    }
   }
   return true;
 }
 
-static bool string2file(const char* filename, FILE* fp,
-                        const char* s);
+/**
+   All or nothing: if any selected hunk conflicts,
+   no hunk is removed, and the caller writes nothing
+*/
+static bool
+stash_pop_hunks(stash_hunks* hunks, stash_select* select,
+                stash_patch* patch, bool* modified)
+{
+  *modified = false;
+  stash_log(STASH_INFO, "patching %s ...", patch->name);
+  if (!stash_preflight(hunks, select, patch, false, "pop"))
+    return false;
+  int applied = 0;
+  for (int i = 0; i < hunks->count; i++)
+    if (stash_select_contains(select, i+1))
+    {
+      stash_hunks_remove(hunks, i);
+      applied++;
+    }
+  *modified = (applied > 0);
+  stash_log(STASH_INFO, "popped %i hunk%s to %s.",
+            applied, plural(applied), patch->name);
+  return true;
+}
 
 static int
 get1char(void)
@@ -230,9 +324,48 @@ get1char(void)
   return c;
 }
 
+static void print_hunk(stash_hunks* hunks, stash_hunk* hunk);
+
+/**
+   Remove the hunk at index
+   @return The next hunk, else the previous hunk, else -1
+*/
+static int
+pop_i_remove(stash_hunks* hunks, int index)
+{
+  stash_hunks_remove(hunks, index);
+  int next = stash_hunks_next(hunks, index);
+  if (next < hunks->count) return next;
+  return stash_hunks_prev(hunks, index);
+}
+
+/** Ask stash_prompt: any other answer than choices means quit */
+static int
+ask_prompt(int index, stash_hunks* hunks, stash_hunk* hunk,
+           const char* choices)
+{
+  int c = stash_prompt(stash_prompt_data, index+1,
+                       stash_hunk_text(hunks, hunk), hunk->length,
+                       choices);
+  if (c <= 0 || strchr(choices, c) == NULL)
+    return 'q';
+  return c;
+}
+
+static int
+prompt_pop(int index, stash_hunks* hunks, stash_hunk* hunk)
+{
+  if (stash_prompt != NULL)
+    return ask_prompt(index, hunks, hunk, "pdkq");
+  printf_color(BLUE, "hunk %i:\n", index);
+  print_hunk(hunks, hunk);
+  printf_color(BLUE, "[p]op [d]rop s[k]ip [q]uit: ");
+  return get1char();
+}
+
 static bool
-stash_pop_hunks_interactive(struct list* hunks, const char* text_name,
-                            stash_file* hunk_file, bool* modified)
+stash_pop_hunks_interactive(stash_hunks* hunks, stash_patch* patch,
+                            bool* modified)
 {
   int  index  = 0;
   bool loop   = true;
@@ -241,23 +374,17 @@ stash_pop_hunks_interactive(struct list* hunks, const char* text_name,
   *modified = false;
   while (loop)
   {
-    void* v; // Needed to avoid pointer aliasing
-    list_get(hunks, index, &v);
-    char* hunk = v;
-    printf_color(BLUE, "hunk %i:\n", index);
-    printf("%s\n", hunk);
-    printf_color(BLUE, "[p]op [d]rop s[k]ip [q]uit: ");
-    int c = get1char();
+    stash_hunk* hunk = &hunks->hunk[index];
+    int c = prompt_pop(index, hunks, hunk);
     switch (c)
     {
       case 'p':
-        b = stash_pop_hunk(text_name, hunk, hunk_file);
-        if (index >= hunks->size) index = hunks->size - 1;
+        b = stash_patch_apply(patch, stash_hunk_text(hunks, hunk),
+                              hunk->length, false);
         if (b)
         {
           *modified = true;
-          list_remove(hunks, hunk);
-          free(hunk);
+          index = pop_i_remove(hunks, index);
         }
         else
         {
@@ -267,19 +394,17 @@ stash_pop_hunks_interactive(struct list* hunks, const char* text_name,
         break;
       case 'd':
         *modified = true;
-        list_remove(hunks, hunk);
-        free(hunk);
-        if (index >= hunks->size) index = hunks->size - 1;
+        index = pop_i_remove(hunks, index);
         break;
       case 'k':
-        index++; // Noop
+        index = stash_hunks_next(hunks, index+1); // Noop
         break;
       case 'q':
         loop = false;
         break;
       // TODO: handle others!
     }
-    if (index < 0 || index >= hunks->size)
+    if (index < 0 || index >= hunks->count)
     {
       stash_log(STASH_INFO, "no more hunks.");
       break;
@@ -288,227 +413,566 @@ stash_pop_hunks_interactive(struct list* hunks, const char* text_name,
   return result;
 }
 
-static bool
-stash_pop_hunk(const char* text_name, const char* hunk,
-               stash_file* hunk_file)
+static void
+print_hunk(stash_hunks* hunks, stash_hunk* hunk)
 {
-  bool b = string2file(hunk_file->name, hunk_file->fp, hunk);
-  CHECK(b, "could not write hunk to: %s", hunk_file->name);
-
-  char cmd[path_max*3];
-  sprintf(cmd, "patch %s %s", text_name, hunk_file->name);
-  stash_log(STASH_INFO, "patching %s ...", text_name);
-  stash_log(STASH_DEBUG, "cmd: %s\n", cmd);
-
-  int rc = system(cmd);
-  CHECK(rc == 0, "could not patch: %s", text_name);
+  stash_hunk_write(hunks, hunk, stdout);
+  printf("\n");
+}
 
-  stash_log(STASH_INFO, "patched %s.", text_name);
-  return true;
+void
+stash_filename(const char* filename, char* output)
+{
+  int count = sprintf(output, "%s.stash", filename);
+  if (count < 0)
+    stash_abort("Could not create stash filename for: %s", filename);
 }
 
-/** TODO: Move to stash_file API */
+/**
+   Find the hunks in text_name: diff it against its BASE text
+   in-process, else parse the output of svn diff.
+   Under stash serve, the hunks and BASE text may be cached.
+   base: OUT: The BASE text diffed against, else its data is NULL:
+              close it with stash_base_close()
+*/
 static bool
-string2file(const char* filename, FILE* fp, const char* s)
+stash_find_hunks(const char* text_name, stash_hunks* hunks,
+                 stash_base* base_out)
 {
-  stash_log(STASH_DEBUG, "string2file: writing to: %s", filename);
-
-  int rc;
-  rc = fseek(fp, 0, SEEK_SET);
-  if (rc != 0) return false;
-
-  rc = ftruncate(fileno(fp), 0);
-  if (rc != 0) return false;
+  if (stash_cache_hunks(text_name, hunks, base_out))
+    return true;
+  bool result = true;
+  stash_diff_cache cache;
+  stash_diff_cache_open(&cache, text_name);
+  if (stash_diff_cache_hunks(&cache, hunks))
+  {
+    // Only worth having for a full push if no svn cat is needed
+    stash_base_open_local(text_name, base_out);
+    stash_cache_store(text_name, hunks, base_out);
+    stash_diff_cache_close(&cache);
+    return true;
+  }
+  stash_base base;
+  char* text = NULL;
+  size_t text_length;
+  if (stash_cache_base(text_name, &base) ||
+      stash_base_open(text_name, &base))
+  {
+    bool b = file_size(text_name, &text_length);
+    CHECK_GOTO(b, done, "could not stat: %s", text_name);
+    text = slurp(text_name);
+    CHECK_GOTO(text != NULL, done, "could not read: %s", text_name);
+    // Leave binary files to svn
+    if (memchr(base.data, '\0', base.length) == NULL &&
+        memchr(text, '\0', text_length) == NULL)
+    {
+      result = stash_diff_cache_diff(&cache, &base,
+                                     text, text_length, hunks);
+      free(text);
+      stash_diff_cache_close(&cache);
+      if (result)
+        stash_cache_store(text_name, hunks, &base);
+      *base_out = base;
+      return result;
+    }
+    free(text);
+    stash_base_close(&base);
+  }
 
-  size_t length = strlen(s);
-  rc = fwrite(s, sizeof(*s), length, fp);
-  if (rc != length)
+  result = stash_make_diff(NULL, text_name, hunks);
+  if (result)
   {
-    perror("stash");
-    return false;
+    stash_diff_cache_store(&cache, hunks, NULL, 0);
+    stash_cache_store(text_name, hunks, NULL);
   }
-  if (ferror(fp)) return false;
-  fflush(fp);
+  stash_diff_cache_close(&cache);
+  return result;
 
-  stash_log(STASH_DEBUG, "string2file: OK");
-  return true;
+  done:
+  free(text);
+  stash_base_close(&base);
+  stash_diff_cache_close(&cache);
+  return result;
 }
 
-void
-stash_filename(const char* filename, char* output)
+/**
+   The argv of an svn command on one path
+   option, changelist: May be NULL
+   argv: OUT: Room for 8 pointers
+*/
+static void
+svn_argv(const char* subcmd, const char* option,
+         const char* changelist, const char* path, const char* argv[])
 {
-  int count = sprintf(output, "%s.stash", filename);
-  if (count < 0)
-    stash_abort("Could not create stash filename for: %s", filename);
+  int i = 0;
+  argv[i++] = "svn";
+  argv[i++] = subcmd;
+  if (option != NULL)
+    argv[i++] = option;
+  if (changelist != NULL)
+  {
+    argv[i++] = "--changelist";
+    argv[i++] = changelist;
+  }
+  argv[i++] = "--";
+  argv[i++] = path;
+  argv[i]   = NULL;
 }
 
-void
-stash_filename_backup(const char* filename, char* output)
+/**
+   Parse the output of svn diff as it arrives: no temp file
+   changelist: May be NULL
+*/
+bool
+stash_make_diff(const char* changelist, const char* path,
+                stash_hunks* hunks)
 {
-  int count = sprintf(output, "%s.stash~", filename);
-  if (count < 0)
-    stash_abort("Could not create stash backup filename for: %s",
-                filename);
+  const char* argv[8];
+  svn_argv("diff", NULL, changelist, path, argv);
+  stash_file diff;
+  stash_file_init(&diff, "diff");
+  bool b = stash_file_spawn(&diff, argv);
+  if (!b) return false;
+  bool parsed = stash_hunks_read(hunks, diff.fp, diff.name);
+  b = stash_file_wait(&diff);
+  return b && parsed;
 }
 
-bool
-stash_make_diff(const char* file, stash_file* diff)
+/** The text files of a tree operation, in stash_arena */
+typedef struct
 {
-  char cmd_short[path_max+128]; // For error message
-  char cmd[path_max*4];
+  char** files;
+  int count;
+  int capacity;
+} tree_list;
 
-  sprintf(cmd_short, "svn diff %s", file);
-  sprintf(cmd, "%s > %s", cmd_short, diff->name);
+/** The list that tree_visit() adds to: nftw() passes no argument */
+static __thread tree_list* tree_visiting = NULL;
 
-  stash_log(STASH_DEBUG, "running: %s", cmd_short);
-  int rc = system(cmd);
-  CHECK(rc == 0, "error occurred in command: %s", cmd_short);
+static void
+tree_add(tree_list* T, const char* text_name)
+{
+  if (T->count == T->capacity)
+  {
+    int c = T->capacity == 0 ? 64 : T->capacity * 2;
+    T->files = stash_grow(T->files, T->capacity * sizeof(char*),
+                          c * sizeof(char*));
+    T->capacity = c;
+  }
+  T->files[T->count++] = arena_strdup(&stash_arena, text_name);
+}
 
-  rewind(diff->fp);
+static int
+tree_visit(const char* path, const struct stat* s, int type,
+           struct FTW* ftw)
+{
+  const char* base = path + ftw->base;
+  if (type == FTW_D && strcmp(base, ".svn") == 0)
+    return FTW_SKIP_SUBTREE;
+  if (type != FTW_F)
+    return FTW_CONTINUE;
+  size_t n = strlen(base);
+  if (n > 6 && strcmp(base+n-6, ".stash") == 0)
+  {
+    char text_name[path_max];
+    strcpy(text_name, path);
+    text_name[strlen(path)-6] = '\0';
+    tree_add(tree_visiting, text_name);
+  }
+  return FTW_CONTINUE;
+}
 
-  return true;
+/**
+   Add the paths printed by an svn command to the tree files
+   prefix: Only lines with this prefix name a path,
+           which starts skip bytes into the line
+   stashed: If true, only add files that have stashes
+*/
+static bool
+tree_svn_paths(tree_list* T, const char* argv[],
+               const char* prefix, size_t skip, bool stashed)
+{
+  stash_file output;
+  stash_file_init(&output, "svn");
+  bool b = stash_file_spawn(&output, argv);
+  if (!b) return false;
+  size_t prefix_length = strlen(prefix);
+  char* line = NULL;
+  size_t size = 0;
+  ssize_t n;
+  while ((n = getline(&line, &size, output.fp)) != -1)
+  {
+    if ((size_t) n <= skip ||
+        strncmp(line, prefix, prefix_length) != 0)
+      continue;
+    while (n > 0 && (line[n-1] == '\n' || line[n-1] == '\r'))
+      line[--n] = '\0';
+    char stash_name[path_max+8];
+    stash_filename(line+skip, stash_name);
+    if (!stashed || access(stash_name, R_OK) == 0)
+      tree_add(T, line+skip);
+  }
+  free(line);
+  return stash_file_wait(&output);
 }
 
-typedef enum
+static int
+tree_cmp(const void* p1, const void* p2)
 {
-  READ_MORE,  // The result is good data
-  READ_END,   // The result is EOF
-  READ_ERROR  // An error occurred
-} read_result;
+  return strcmp(*(char* const*) p1, *(char* const*) p2);
+}
+
+/** Files without a pristine per svn diff: larger sets are split */
+#define TREE_DIFF_FILES 512
 
-typedef enum
+/** Where a file of a tree push gets its hunks */
+typedef struct
+{
+  /** The svn diff that has the file, or NULL to diff in-process */
+  stash_sched_job* job;
+  /** The file in the output of job, or -1 if it is not there */
+  int file;
+} push_tree_file;
+
+/** The files of a tree push */
+typedef struct
 {
-  HUNK_PROTO, // New variable
-  HUNK_MORE,  // The next line is a hunk "@@"
-  HUNK_END,   // The next line is the end of file
-  HUNK_ERROR  // An error occurred
-} hunk_result;
+  tree_list* tree;
+  push_tree_file* file;
+} push_tree_work;
 
-static hunk_result   read_hunk(FILE* diff, char* line, int* number,
-                             buffer* b);
-static read_result read_line(FILE* fp, char* line, int number);
+static bool
+push_tree_task(int index, void* arg)
+{
+  push_tree_work* work = arg;
+  const char* text_name = work->tree->files[index];
+  push_tree_file* file = &work->file[index];
+  bool result = true;
+  bool b;
+  stash_hunks local;
+  stash_hunks_init(&local);
+  stash_hunks* hunks = &local;
+  stash_base base = { NULL, 0, false };
+  // The hunks of this file are first..first+count-1 of hunks
+  int first = 0, count = 0;
+  if (file->job != NULL)
+  {
+    CHECK_GOTO(file->job->ok, done, "could not diff: %s", text_name);
+    hunks = file->job->hunks;
+    if (file->file >= 0)
+    {
+      first = hunks->file[file->file].first;
+      count = hunks->file[file->file].count;
+    }
+  }
+  else
+  {
+    b = stash_find_hunks(text_name, &local, &base);
+    CHECK_GOTO(b, done, "could not diff: %s", text_name);
+    count = local.count;
+  }
+  // Binary files and property changes have no hunks
+  if (count == 0)
+  {
+    stash_log(STASH_DEBUG, "no hunks in: %s", text_name);
+    goto done;
+  }
+
+  char stash_name[path_max+8];
+  stash_filename(text_name, stash_name);
+  stash_log(STASH_DEBUG, "pushing %i hunk%s: %s",
+            count, plural(count), text_name);
+  stash_select select;
+  stash_select_range(&select, hunks->count, first+1, first+count);
+  b = stash_push_select(hunks, &select, text_name, stash_name, &base);
+  stash_select_finalize(&select);
+  CHECK_GOTO(b, done, "could not push: %s", text_name);
+
+  done:
+  stash_base_close(&base);
+  stash_hunks_finalize(&local);
+  return result;
+}
+
+/** Find the files of the tree in the output of an svn diff */
+static void
+tree_diff_files(tree_list* tree, stash_sched_job* job,
+                push_tree_file* file)
+{
+  stash_hunks* hunks = job->hunks;
+  for (int f = 0; f < hunks->files; f++)
+  {
+    char text_name[path_max];
+    stash_hunks_file_name(hunks, f, text_name);
+    const char* key = text_name;
+    char** found = bsearch(&key, tree->files, tree->count,
+                           sizeof(char*), tree_cmp);
+    if (found == NULL)
+    {
+      stash_log(STASH_DEBUG, "not in the tree: %s", text_name);
+      continue;
+    }
+    push_tree_file* F = &file[found - tree->files];
+    if (F->job == job)
+      F->file = f;
+  }
+}
 
-/** adds hunks in diff_name/diff_fp to list hunks */
 bool
-stash_parse_diff(stash_file* diff, struct list* hunks)
-{
-  int number = 1;
-  stash_log(STASH_DEBUG, "parsing diff: %s", diff->name);
-  // Reusable line buffer:
-  char line[MAX_LINE];
-  while (true)
-  {
-    read_result rr = read_line(diff->fp, line, number);
-    CHECK(rr != READ_ERROR, "read error in %s", diff->name);
-    if (rr == READ_END) return true;
-    if (strncmp(line, "Index:", 6) == 0) continue;
-    if (strncmp(line, "+++",    3) == 0) continue;
-    if (strncmp(line, "---",    3) == 0) continue;
-    if (strncmp(line, "===",    3) == 0) continue;
-    break; // found some text
-    number++;
-  }
-  buffer B;
-  buffer_init(&B, MAX_LINE);
-  hunk_result hr = HUNK_PROTO;
-  while (true)
-  {
-    if (strncmp(line, "@@", 2) == 0)
+stash_push_tree(const char* dir, const char* changelist)
+{
+  if (dir == NULL) dir = ".";
+  const char* argv[8];
+  svn_argv("status", "-q", changelist, dir, argv);
+  tree_list tree = { NULL, 0, 0 };
+  bool b = tree_svn_paths(&tree, argv, "M", 8, false);
+  CHECK(b, "push: could not get status of: %s", dir);
+  qsort(tree.files, tree.count, sizeof(char*), tree_cmp);
+  stash_log(STASH_INFO, "found %i modified file%s",
+            tree.count, plural(tree.count));
+
+  push_tree_work work;
+  work.tree = &tree;
+  work.file = stash_alloc(tree.count * sizeof(push_tree_file));
+  int* fallback = stash_alloc(tree.count * sizeof(int));
+  int fallbacks = 0;
+  for (int i = 0; i < tree.count; i++)
+    if (!stash_base_local(tree.files[i]))
+      fallback[fallbacks++] = i;
+
+  // Without a pristine, svn diffs the files: one svn diff for them
+  // all, split on its "Index: " lines, or a few at once if many
+  int count = (fallbacks + TREE_DIFF_FILES - 1) / TREE_DIFF_FILES;
+  stash_sched_job* jobs = stash_alloc(count * sizeof(stash_sched_job));
+  for (int j = 0; j < count; j++)
+  {
+    int first = j * TREE_DIFF_FILES;
+    int n = fallbacks - first < TREE_DIFF_FILES ?
+            fallbacks - first : TREE_DIFF_FILES;
+    const char** job_argv = stash_alloc((n+4) * sizeof(char*));
+    job_argv[0] = "svn";
+    job_argv[1] = "diff";
+    job_argv[2] = "--";
+    for (int k = 0; k < n; k++)
     {
-      buffer_appendv(&B, "%s", line);
-      hr = read_hunk(diff->fp, line, &number, &B);
-      CHECK(hr != HUNK_ERROR, "read error in %s", diff->name);
-      char* hunk = buffer_dup(&B);
-      list_add(hunks, hunk);
+      int i = fallback[first+k];
+      job_argv[3+k] = tree.files[i];
+      work.file[i].job = &jobs[j];
+      work.file[i].file = -1;
     }
-    if (hr == HUNK_END) break;
-    buffer_reset(&B);
+    job_argv[3+n] = NULL;
+    jobs[j].argv = job_argv;
+    jobs[j].hunks = stash_alloc(sizeof(stash_hunks));
+    stash_hunks_init(jobs[j].hunks);
   }
-  buffer_finalize(&B);
+  if (fallbacks > 0)
+    stash_log(STASH_DEBUG, "no pristine for %i file%s: using svn diff",
+              fallbacks, plural(fallbacks));
+  stash_sched_run(jobs, count, stash_pool_workers());
+  for (int j = 0; j < count; j++)
+    tree_diff_files(&tree, &jobs[j], work.file);
+
+  int failed = stash_pool_run(tree.count, push_tree_task, &work);
+  for (int j = 0; j < count; j++)
+    stash_hunks_finalize(jobs[j].hunks);
+  int pushed = tree.count - failed;
+  stash_log(STASH_INFO, "pushed %i file%s", pushed, plural(pushed));
+  return failed == 0;
+}
+
+static bool
+pop_tree_task(int index, void* arg)
+{
+  tree_list* tree = arg;
+  bool b = stash_pop(tree->files[index], "@");
+  CHECK(b, "could not pop: %s", tree->files[index]);
   return true;
 }
 
-static read_result
-read_line(FILE* fp, char* line, int number)
+bool
+stash_pop_tree(const char* dir, const char* changelist)
+{
+  if (dir == NULL) dir = ".";
+  bool b;
+  tree_list tree = { NULL, 0, 0 };
+  if (changelist != NULL)
+  {
+    // Members of the changelist are clean after a push:
+    // svn info lists them, where svn status would not
+    const char* argv[8];
+    svn_argv("info", "-R", changelist, dir, argv);
+    b = tree_svn_paths(&tree, argv, "Path: ", 6, true);
+  }
+  else
+  {
+    tree_visiting = &tree;
+    b = (nftw(dir, tree_visit, 16, FTW_PHYS|FTW_ACTIONRETVAL) == 0);
+    tree_visiting = NULL;
+  }
+  CHECK(b, "pop: could not find stashes in: %s", dir);
+  qsort(tree.files, tree.count, sizeof(char*), tree_cmp);
+  stash_log(STASH_INFO, "found %i stash%s",
+            tree.count, tree.count == 1 ? "" : "es");
+
+  int failed = stash_pool_run(tree.count, pop_tree_task, &tree);
+  int popped = tree.count - failed;
+  stash_log(STASH_INFO, "popped %i file%s", popped, plural(popped));
+  return failed == 0;
+}
+
+static const char* list_columns =
+  "file\thunk\told_start\told_count\tnew_start\tnew_count\t"
+  "added\tremoved\tbytes\tchecksum\n";
+
+/** Print s as a JSON string */
+static void
+print_json_string(const char* s)
 {
-  if (fgets(line, MAX_LINE, fp) == NULL)
-    return READ_END;
-  char* c = strchr(line, '\n');
-  if (c == NULL)
+  stash_print("\"");
+  for (const char* p = s; *p != '\0'; p++)
   {
-    printf("stash: line %i is too long! limit: %i\n",
-           number, MAX_LINE);
-    return READ_ERROR;
+    unsigned char c = *p;
+    if (c == '"' || c == '\\')
+      stash_print("\\%c", c);
+    else if (c < 0x20)
+      stash_print("\\u%04x", c);
+    else
+      stash_print("%c", c);
   }
-  return READ_MORE;
+  stash_print("\"");
 }
 
-/**
-   diff_fp: IN:     The file pointer to use
-   line:    IN:     The current line buffer (reusable)
-   number:  IN/OUT: The current line number
-   buffer:     OUT: New buffer contents are appended here
- */
-static hunk_result
-read_hunk(FILE* diff_fp, char* line, int* number, buffer* b)
+/** Print s as a TSV field, with tab, newline, CR and backslash escaped */
+static void
+print_tsv_string(const char* s)
 {
-  while (true)
+  for (const char* p = s; *p != '\0'; p++)
   {
-    if (fgets(line, MAX_LINE, diff_fp) == NULL)
-      break;
-    char* c = strchr(line, '\n');
-    if (c == NULL)
+    switch (*p)
     {
-      printf("stash: line %i is too long! limit: %i\n",
-             *number, MAX_LINE);
-      return HUNK_ERROR;
+      case '\t': stash_print("\\t");  break;
+      case '\n': stash_print("\\n");  break;
+      case '\r': stash_print("\\r");  break;
+      case '\\': stash_print("\\\\"); break;
+      default:   stash_print("%c", *p);
     }
-    (*number)++;
-    if (strncmp(line, "@@", 2) == 0)
-      return HUNK_MORE;
-    bool rc = buffer_append(b, line);
-    if (!rc)
-      stash_abort("Failed to allocate memory!");
   }
-  return HUNK_END;
 }
 
 static bool
-hunk_ids_contains(int index, struct list* hunk_ids)
+list_format(const char* format, bool* json)
 {
-  for (struct list_item* item = hunk_ids->head;
-       item != NULL;
-       item = item->next)
+  *json = false;
+  if (format == NULL || strcmp(format, "tsv") == 0)
+    return true;
+  CHECK(strcmp(format, "json") == 0, "list: unknown format: %s", format);
+  *json = true;
+  return true;
+}
+
+/** Print the hunks of one stash, if it exists */
+static bool
+list_file(const char* text_name, bool json)
+{
+  char stash_name[path_max+8];
+  stash_filename(text_name, stash_name);
+  stash_index_entry* entries = NULL;
+  int count = 0;
+  // No stash: no hunks
+  if (access(stash_name, F_OK) == 0 &&
+      !stash_index_entries(stash_name, &entries, &count))
+    return false;
+
+  if (json)
+  {
+    stash_print("{\"file\":");
+    print_json_string(text_name);
+    stash_print(",\"stash\":");
+    print_json_string(stash_name);
+    stash_print(",\"hunks\":[");
+  }
+  for (int i = 0; i < count; i++)
   {
-    char* spec = item->data;
-    stash_log(STASH_TRACE,
-              "hunk_ids_contains: index=%i spec=%s", index, spec);
-    if (strcmp(spec, "@") == 0)
-      return true;
-    // TODO: Handle ranges
-    errno = 0;
-    char* end;
-    long value = strtol(spec, &end, 10);
-    if (end == spec || errno != 0)
-      stash_abort("bad integer in hunk spec: '%s'", spec);
-    // printf("value=%li spec=%s\n", value, spec);
-    if (value == index)
-      // Found:
-      return true;
+    stash_index_entry* E = &entries[i];
+    if (json)
+      stash_print("%s{\"hunk\":%i,\"old_start\":%i,\"old_count\":%i,"
+                  "\"new_start\":%i,\"new_count\":%i,"
+                  "\"added\":%i,\"removed\":%i,"
+                  "\"bytes\":%llu,\"checksum\":\"%08x\"}",
+                  i == 0 ? "" : ",", i+1,
+                  E->old_start, E->old_count, E->new_start, E->new_count,
+                  E->added, E->removed,
+                  (unsigned long long) E->length, E->checksum);
+    else
+    {
+      print_tsv_string(text_name);
+      stash_print("\t%i\t%i\t%i\t%i\t%i\t%i\t%i\t%llu\t%08x\n",
+                  i+1,
+                  E->old_start, E->old_count, E->new_start, E->new_count,
+                  E->added, E->removed,
+                  (unsigned long long) E->length, E->checksum);
+    }
   }
+  if (json)
+    stash_print("]}\n");
+  return true;
+}
 
-  // Not found:
-  return false;
+bool
+stash_list(const char* text_name, const char* format)
+{
+  bool json;
+  if (!list_format(format, &json)) return false;
+  if (!json) stash_print("%s", list_columns);
+  return list_file(text_name, json);
+}
+
+bool
+stash_list_tree(const char* dir, const char* format)
+{
+  if (dir == NULL) dir = ".";
+  bool json;
+  if (!list_format(format, &json)) return false;
+  tree_list tree = { NULL, 0, 0 };
+  tree_visiting = &tree;
+  bool b = (nftw(dir, tree_visit, 16, FTW_PHYS|FTW_ACTIONRETVAL) == 0);
+  tree_visiting = NULL;
+  CHECK(b, "list: could not find stashes in: %s", dir);
+  qsort(tree.files, tree.count, sizeof(char*), tree_cmp);
+
+  if (!json) stash_print("%s", list_columns);
+  bool result = true;
+  for (int i = 0; i < tree.count; i++)
+    if (!list_file(tree.files[i], json))
+      result = false;
+  return result;
 }
 
-static bool stash_resolve_hunk(const char* hunk,
-                               const char* text_name,
-                               stash_file* diff,
-                               const char* errs_name);
+/** A section being appended to a stash file by one push */
+typedef struct
+{
+  stash_file file;
+  /** The stash file before this push */
+  struct stat before;
+  bool opened;
+  /** Byte offset of the next hunk in the stash file */
+  size_t offset;
+  /** Index entries for the new hunks */
+  stash_index_entry* entries;
+  int count;
+  int capacity;
+} stash_section;
+
+static void stash_section_init(stash_section* S,
+                               const char* stash_name);
 
-static bool cp_fps(FILE* fp1, FILE* fp2);
+static bool stash_section_add(stash_section* S, stash_hunks* H,
+                              stash_hunk* hunk);
 
-static int prompt_push(int index, const char* hunk);
+static bool stash_section_close(stash_section* S);
+
+static int prompt_push(int index, stash_hunks* hunks,
+                       stash_hunk* hunk);
 
 static void push_i_switch_s(bool success, int* index, int* pushes,
                             bool* loop, bool* result);
@@ -517,55 +981,52 @@ static void push_i_switch_d(bool success, int* index,
                             bool* loop, bool* result);
 
 static bool
-stash_push_hunks_interactive(struct list* hunks,
-                             const char*  text_name,
-                             stash_file*  diff)
+stash_push_hunks_interactive(stash_hunks* hunks,
+                             const char*  text_name)
 {
   stash_log(STASH_DEBUG, "stash_push_hunks_interactive...");
 
-  stash_file stash, stash_backup;
-  bool stash_existed;
-  char* stash_previous = NULL;
-  stash_file_init(&stash,        "stash");
-  stash_file_init(&stash_backup, "backup");
-  stash_filename       (text_name, stash.name);
-  stash_filename_backup(text_name, stash_backup.name);
-  stash_file_fopen_rw_exists(&stash, &stash_existed);
-
-  if (stash_existed)
-  {
-    stash_file_fopen_w(&stash_backup);
-    stash_file_slurp(&stash, &stash_previous);
-    stash_file_append(&stash_backup, stash_previous);
-    stash_file_close(&stash_backup);
-    stash_file_clobber(&stash);
-  }
-
-  stash_file errs;
-  stash_temp_file(&errs, "errors");
+  bool b;
+  char stash_name[path_max];
+  stash_filename(text_name, stash_name);
+  struct stat before;
+  if (stat(stash_name, &before) != 0)
+    before.st_size = -1;
+  stash_section section;
+  stash_section_init(&section, stash_name);
+
+  stash_patch patch;
+  b = stash_patch_load(&patch, text_name);
+  CHECK(b, "push: could not load: %s", text_name);
 
   int  index  = 0;
   int  pushes  = 0;
   bool loop   = true;
   bool result = true;
-  bool b;
+  // False if a hunk could not be written to the stash
+  bool stashed = true;
 
   while (loop)
   {
-    void* v;
-    list_get(hunks, index, &v);
-    char* hunk = v;
-    int c = prompt_push(index, hunk);
+    stash_hunk* hunk = &hunks->hunk[index];
+    const char* text = stash_hunk_text(hunks, hunk);
+    int c = prompt_push(index, hunks, hunk);
     switch (c)
     {
       case 's':
-        stash_file_append(&stash, hunk);
-        b = stash_resolve_hunk(hunk, text_name, diff, errs.name);
+        // Only a hunk that comes out of the text goes to the stash
+        b = stash_patch_apply(&patch, text, hunk->length, true);
+        if (b && !stash_section_add(&section, hunks, hunk))
+        {
+          stashed = false;
+          result  = false;
+          loop    = false;
+          break;
+        }
         push_i_switch_s(b, &index, &pushes, &loop, &result);
         break;
       case 'd':
-        b = stash_resolve_hunk(hunk, text_name,
-                               diff, errs.name);
+        b = stash_patch_apply(&patch, text, hunk->length, true);
         push_i_switch_d(b, &index, &loop, &result);
         break;
       case 'k':
@@ -575,32 +1036,35 @@ stash_push_hunks_interactive(struct list* hunks,
         loop = false;
         break;
     }
-    if (index >= hunks->size)
+    if (index >= hunks->count)
       break;
   }
-  stash_temp_delete(&errs);
 
-  if (stash_existed)
-  {
-    stash_file_append(&stash, stash_previous);
-    free(stash_previous);
-  }
-
-  stash_file_close(&stash);
+  // The stash is synced before the text is written
+  bool closed = stash_section_close(&section) && stashed;
+  bool saved = closed && stash_patch_save(&patch);
+  stash_patch_finalize(&patch);
+  // The hunks are still in the text: take them back out of the stash
+  if (!saved && section.opened)
+    stash_unpush(stash_name, before.st_size);
+  CHECK(closed, "push: could not write: %s", stash_name);
+  CHECK(saved, "push: could not write: %s", text_name);
 
   stash_log(STASH_INFO, "pushed %i hunk%s to %s",
-            pushes, plural(pushes), stash.name);
+            pushes, plural(pushes), stash_name);
   return result;
 }
 
 static int
-prompt_push(int index, const char* hunk)
+prompt_push(int index, stash_hunks* hunks, stash_hunk* hunk)
 {
+  if (stash_prompt != NULL)
+    return ask_prompt(index, hunks, hunk, "sdkq");
   printf_color(BLUE, "hunk");
   printf(" %i", index+1);
   printf_color(BLUE, ":");
   printf("\n");
-  printf("%s\n", hunk);
+  print_hunk(hunks, hunk);
   printf_color(BLUE, "[s]ave [d]rop s[k]ip [q]uit: ");
   int c = get1char();
   return c;
@@ -643,172 +1107,323 @@ push_i_switch_d(bool success, int* index, bool* loop, bool* result)
 }
 
 bool
-stash_push_ids(struct list* hunks, const char* hunk_ids_s,
-               const char* text_name, const char* stash_name)
+stash_push_ids(stash_hunks* hunks, const char* hunk_ids_s,
+               const char* text_name, const char* stash_name,
+               const stash_base* base)
 {
-  bool b;
-  struct list hunk_ids;
-  list_init(&hunk_ids);
-  list_split(&hunk_ids, hunk_ids_s, ',');
-  b = stash_push_hunks(hunks, &hunk_ids, stash_name);
+  stash_select select;
+  bool b = stash_select_parse(&select, hunk_ids_s, hunks->count);
   CHECK(b, "push failed!");
-  b = stash_resolve(hunks, &hunk_ids, text_name);
-  CHECK(b, "resolve failed to %s!", text_name);
-  list_destruct(&hunk_ids, NULL);
-  return true;
+  b = stash_push_select(hunks, &select, text_name, stash_name, base);
+  stash_select_finalize(&select);
+  return b;
 }
 
+/**
+   base: The BASE text the hunks were diffed against, if its data
+         is not NULL: if all hunks are pushed, the result is the
+         BASE text, so it is copied instead of reverse-patched
+   Else every hunk is removed from the text in memory first,
+   so a conflict is found before the stash or text is written.
+   If the stash was empty, the text is saved first,
+   so that popping all of it can restore the saved text
+*/
 static bool
-cp_fps(FILE* fp1, FILE* fp2)
+stash_push_select(stash_hunks* hunks, stash_select* select,
+                  const char* text_name, const char* stash_name,
+                  const stash_base* base)
 {
-  stash_log(STASH_TRACE, "cp_fps() ...");
-  const int chunk = 64*1024;
-  char t[chunk];
-  while (true)
+  bool result = true;
+  bool b;
+  bool restore = (base->data != NULL && stash_select_full(select));
+  stash_patch patch;
+  if (!restore)
   {
-    stash_log(STASH_TRACE, "chunk:  %i %p", chunk, fp1);
-    int actual = fread(t, 1, chunk, fp1);
-    stash_log(STASH_TRACE, "actual:  %i", actual);
-    int written = fwrite(t, 1, actual, fp2);
-    stash_log(STASH_TRACE, "written: %i", written);
-    CHECK(actual == written, "cp_fps write error!");
-    if (written < chunk) break;
+    b = stash_patch_load(&patch, text_name);
+    CHECK(b, "could not load: %s", text_name);
+    if (!stash_preflight(hunks, select, &patch, true, "push"))
+    {
+      stash_patch_finalize(&patch);
+      FAIL("push: nothing was changed: %s", text_name);
+    }
   }
-  return true;
+
+  struct stat before;
+  if (stat(stash_name, &before) != 0)
+    before.st_size = -1;
+  stash_image image;
+  stash_image_begin(&image, text_name, stash_name);
+  b = stash_push_hunks(hunks, select, stash_name);
+  CHECK_GOTO(b, failed, "push failed!");
+  if (restore)
+    b = stash_base_restore(base, text_name);
+  else
+    b = stash_patch_save(&patch);
+  CHECK_GOTO(b, failed, "could not write: %s", text_name);
+  stash_image_commit(&image, text_name, stash_name);
+  goto done;
+
+  failed:
+  // The hunks are still in the text: take them back out of the stash
+  stash_unpush(stash_name, before.st_size);
+  done:
+  stash_image_abort(&image);
+  if (!restore)
+    stash_patch_finalize(&patch);
+  return result;
 }
 
 static bool
-stash_push_hunks(struct list* hunks, struct list* hunk_ids,
+stash_push_hunks(stash_hunks* hunks, stash_select* select,
                  const char* stash_name)
 {
-  stash_file tmp;
-  stash_temp_file_fopen(&tmp, "push_tmp");
+  bool result = true;
+  stash_section section;
+  stash_section_init(&section, stash_name);
 
-  struct list_item* item = hunks->head;
-  int i = 1;
-  while (item != NULL)
+  for (int i = 0; i < hunks->count; i++)
   {
-    if (hunk_ids_contains(i, hunk_ids))
-      stash_file_append(&tmp, item->data);
-    item = item->next;
-    i++;
+    if (stash_select_contains(select, i+1))
+    {
+      bool b = stash_section_add(&section, hunks, &hunks->hunk[i]);
+      CHECK_GOTO(b, done, "could not write to stash: %s", stash_name);
+    }
   }
 
-  stash_file stash;
-  stash_file_init_name(&stash, "stash", stash_name);
-  stash_file_fopen_rw(&stash);
-  cp_fps(stash.fp, tmp.fp);
-  // fflush(tmp.fp);
-  rewind(tmp.fp);
-  rewind(stash.fp);
-  cp_fps(tmp.fp, stash.fp);
-
-  bool b;
-  b = stash_file_close(&stash);
-  CHECK(b, "close error");
-  b = stash_file_close(&tmp);
-  CHECK(b, "close error");
-  return true;
+  done:
+  if (!stash_section_close(&section))
+    result = false;
+  return result;
 }
 
-static bool
-stash_overwrite_stash(struct list* hunks, const char* stash_name)
+static void
+stash_section_init(stash_section* S, const char* stash_name)
 {
-  // TODO: Make backup file
-  stash_log(STASH_INFO, "overwriting %s with %i hunks.",
-            stash_name, hunks->size);
-  bool b;
-  stash_file stash;
-  stash_file_init_name(&stash, "stash", stash_name);
-  b = stash_file_fopen_w(&stash);
-  CHECK(b, "could not overwrite stash!");
-  for (struct list_item* item = hunks->head;
-       item != NULL;
-       item = item->next)
-  {
-    b = stash_file_append(&stash, item->data);
-    CHECK(b, "write failed!");
-  }
-  b = stash_file_close(&stash);
-  assert(b);
-  return true;
+  memset(S, 0, sizeof(*S));
+  stash_file_init_name(&S->file, "stash", stash_name);
+  if (stat(stash_name, &S->before) != 0)
+    memset(&S->before, 0, sizeof(S->before));
+  S->offset = S->before.st_size;
 }
 
+/** Open the stash for appending and start the section */
 static bool
-stash_resolve(struct list* hunks, struct list* hunk_ids,
-              const char* text_name)
+stash_section_open(stash_section* S)
 {
-  stash_log(STASH_DEBUG, "resolving: %s", text_name);
-  stash_file diff, errs;
-  stash_temp_file_fopen(&diff, "diff");
-  stash_temp_file(&errs, "errs");
+  bool b = stash_file_fopen_a(&S->file);
+  CHECK(b, "could not open stash: %s", S->file.name);
+  S->opened = true;
 
-  struct list_item* item = hunks->head;
-  int i = 1;
-  while (item != NULL)
+  // An edited stash may lack a final newline
+  char last = '\n';
+  if (S->before.st_size > 0)
   {
-    if (hunk_ids_contains(i, hunk_ids))
-      stash_resolve_hunk(item->data, text_name,
-                         &diff, errs.name);
-    item = item->next;
-    i++;
+    int fd = open(S->file.name, O_RDONLY);
+    if (fd != -1)
+    {
+      if (pread(fd, &last, 1, S->before.st_size-1) != 1)
+        last = '\n';
+      close(fd);
+    }
+  }
+  if (last != '\n')
+  {
+    fputc('\n', S->file.fp);
+    S->offset++;
   }
 
-  stash_file_close(&errs);
-
+  char stamp[64];
+  time_t now = time(NULL);
+  struct tm tm;
+  localtime_r(&now, &tm);
+  strftime(stamp, sizeof(stamp), "%Y-%m-%d %H:%M:%S", &tm);
+  int count = fprintf(S->file.fp, "%s %s\n",
+                      STASH_SECTION_MARKER, stamp);
+  CHECK(count > 0, "could not write to: %s", S->file.name);
+  S->offset += count;
   return true;
 }
 
-static bool patch_errs(int rc, const char* errs_name);
-
 static bool
-stash_resolve_hunk(const char* hunk, const char* text_name,
-                   stash_file* diff,
-                   const char* errs_name)
+stash_section_add(stash_section* S, stash_hunks* H, stash_hunk* hunk)
 {
-  stash_log(STASH_DEBUG, "stash_resolve_hunk...");
-  stash_file_clobber(diff);
-  size_t length = strlen(hunk);
-
-  int rc;
-  rc = fwrite(hunk, sizeof(char), length, diff->fp);
-  CHECK(rc >= 0, "could not write hunk to %s", diff->name);
-  fflush(diff->fp);
-
-  char cmd[path_max*3];
-  sprintf(cmd, "patch -R %s < %s 2>&1 > %s",
-          text_name, diff->name, errs_name);
-  stash_log(STASH_DEBUG, "running: %s", cmd);
-
-  rc = system(cmd);
-  stash_log(STASH_DEBUG, "exit code: %i", rc);
-
-  bool b = patch_errs(rc, errs_name);
-  CHECK(b, "error applying patch");
+  bool b;
+  if (!S->opened)
+  {
+    b = stash_section_open(S);
+    if (!b) return false;
+  }
+  b = stash_file_write(&S->file, stash_hunk_text(H, hunk),
+                       hunk->length);
+  if (!b) return false;
 
+  if (S->count == S->capacity)
+  {
+    int c = S->capacity == 0 ? 16 : S->capacity * 2;
+    S->entries = stash_grow(S->entries,
+                            S->capacity * sizeof(stash_index_entry),
+                            c * sizeof(stash_index_entry));
+    S->capacity = c;
+  }
+  stash_index_entry_make(H, hunk, S->offset, &S->entries[S->count++]);
+  S->offset += hunk->length;
   return true;
 }
 
-/** Reports the output from patch if verbose or on error */
+/** The new hunks are numbered first: put them first in the index */
 static bool
-patch_errs(int rc, const char* errs_name)
+stash_section_close(stash_section* S)
 {
-  if (rc == 0 && stash_verbosity <= STASH_INFO) return true;
+  bool result = true;
+  if (S->opened)
+  {
+    // The stash is appended to in place: sync it before the text
+    bool b = stash_file_sync(&S->file);
+    if (b && S->before.st_size == 0)
+      b = stash_file_sync_dir(S->file.name);
+    if (!stash_file_close(&S->file)) b = false;
+    CHECK_GOTO(b, done, "could not close: %s", S->file.name);
+    stash_index_prepend(S->file.name, &S->before,
+                        S->entries, S->count);
+  }
+  done:
+  return result;
+}
 
-  if (rc != 0) stash_log(STASH_WARN, "patch returned an error:");
+/**
+   The stash may be mapped by hunks:
+   write a new file beside it and rename it into place.
+   The hunks are copied file to file, and the index is written
+   from what is already known about them.
+*/
+static bool
+stash_overwrite_stash(stash_hunks* hunks, const char* stash_name)
+{
+  stash_log(STASH_INFO, "overwriting %s with %i hunks.",
+            stash_name, hunks->live);
+  bool result = true;
+  bool b;
+  int fd = open(stash_name, O_RDONLY);
+  CHECK(fd != -1, "could not open: %s", stash_name);
+  stash_file stash;
+  b = stash_file_temp(&stash, "stash", stash_name);
+  CHECK_GOTO(b, done, "could not overwrite stash!");
+  struct stat st;
+  if (fstat(fd, &st) == 0)
+    fchmod(stash.fd, st.st_mode & 0777);
+
+  stash_hunks_compact(hunks);
+  stash_index_entry* entries =
+    stash_alloc(hunks->count * sizeof(stash_index_entry));
+  int count = 0;
+  size_t offset = 0;
+  for (int i = 0; i < hunks->count; i++)
+  {
+    stash_hunk* hunk = &hunks->hunk[i];
+    b = stash_file_copy_range(&stash, fd, hunk->offset, hunk->length);
+    CHECK_GOTO(b, failed, "write failed!");
+    stash_index_entry_make(hunks, hunk, offset, &entries[count++]);
+    offset += hunk->length;
+  }
+  b = stash_file_temp_commit(&stash, stash_name);
+  CHECK_GOTO(b, done, "could not overwrite stash!");
+  stash_index_write(stash_name, entries, count);
+  stash_image_remove(stash_name);
+
+  failed:
+  if (!result && stash.fd > 0)
+    stash_temp_delete(&stash);
+  done:
+  close(fd);
+  return result;
+}
 
+/**
+   Replace the text with the file open on previous,
+   the text before it was renamed over
+*/
+static bool
+stash_put_back(const char* text_name, int previous)
+{
   struct stat s;
-  stat(errs_name, &s);
-  if (s.st_size > 0)
+  CHECK(fstat(previous, &s) == 0, "could not stat: %s", text_name);
+  char target[path_max];
+  stash_file tmp;
+  bool b = stash_file_temp_replace(&tmp, "text", text_name, target);
+  if (!b) return false;
+  if (!stash_file_clone(&tmp, previous, s.st_size))
   {
-    char* errs = slurp(errs_name);
-    CHECK(errs != NULL, "error reading errs file");
-    puts(errs);
-    free(errs);
+    stash_temp_delete(&tmp);
+    FAIL("could not write: %s", text_name);
   }
+  return stash_file_temp_commit(&tmp, target);
+}
 
-  if (rc != 0) return false;
-  return true;
+/**
+   The popped hunks are in the text: drop them from the stash.
+   If the stash cannot be written, put the text back,
+   so the hunks are never in both
+   previous: Open on the text as it was before the pop
+*/
+static bool
+stash_pop_commit(stash_hunks* hunks, const char* stash_name,
+                 const char* text_name, int previous)
+{
+  if (stash_overwrite_stash(hunks, stash_name))
+    return true;
+  if (stash_put_back(text_name, previous))
+    FAIL("pop: could not write: %s: %s is unchanged",
+         stash_name, text_name);
+  FAIL("pop: could not write: %s: the hunks are in %s and the stash",
+       stash_name, text_name);
+}
+
+/**
+   Apply every selected hunk to the text in memory,
+   going on past conflicts, so they are all reported at once
+   reverse: True to remove the hunks from the text, for push
+   @return False if any hunk conflicts
+*/
+static bool
+stash_preflight(stash_hunks* hunks, stash_select* select,
+                stash_patch* patch, bool reverse, const char* action)
+{
+  stash_log(STASH_DEBUG, "preflight: %s %s", action, patch->name);
+  buffer conflicts;
+  buffer_init(&conflicts, 64);
+  int failed = 0;
+  for (int i = 0; i < hunks->count; i++)
+  {
+    stash_hunk* hunk = &hunks->hunk[i];
+    if (!stash_select_contains(select, i+1))
+      continue;
+    if (stash_patch_apply(patch, stash_hunk_text(hunks, hunk),
+                          hunk->length, reverse))
+      continue;
+    buffer_appendv(&conflicts, "%s%i", failed == 0 ? "" : ",", i+1);
+    failed++;
+  }
+  if (failed > 0)
+    stash_fail("%s: hunk%s %s conflict%s with %s",
+               action, plural(failed), conflicts.data,
+               failed == 1 ? "s" : "", patch->name);
+  buffer_finalize(&conflicts);
+  return failed == 0;
+}
+
+/**
+   Undo a push to the stash, e.g., if the text could not be written
+   size: The size of the stash before the push, or -1 if it was new
+*/
+static void
+stash_unpush(const char* stash_name, off_t size)
+{
+  if (size < 0)
+    unlink(stash_name);
+  else if (truncate(stash_name, size) != 0)
+    stash_log(STASH_WARN, "could not undo push to: %s", stash_name);
+  // Rebuilt when needed
+  stash_index_remove(stash_name);
 }
 
 void
@@ -823,7 +1438,10 @@ stash_abort(const char* format, ...)
   count += vsnprintf(buffer+count, (size_t)(path_max*3-count),
                      format, ap);
   va_end(ap);
-  printf("%s\n", buffer);
+  stash_print("%s\n", buffer);
+  stash_error_set(buffer + strlen("stash: "));
+  if (stash_abort_jump != NULL)
+    longjmp(*stash_abort_jump, 1);
   fflush(NULL);
   exit(EXIT_FAILURE);
 }
@@ -5,8 +5,10 @@
 #define _GNU_SOURCE // for asprintf()
 #endif
 
+#include <setjmp.h>
 #include <stdbool.h>
 
+#include "arena.h"
 #include "list.h"
 
 #include "stash_file.h"
@@ -14,14 +16,28 @@
 typedef enum
 {
   STASH_SUBCMD_PUSH,
-  STASH_SUBCMD_POP
+  STASH_SUBCMD_POP,
+  STASH_SUBCMD_LIST,
+  STASH_SUBCMD_SERVE
 } stash_subcmd;
 
 /** Initialize before any user input */
 bool stash_init(void);
 
-/** Initialize after user command line arguments */
-bool stash_init_tmp(void);
+/** Release the storage of the command */
+void stash_finalize(void);
+
+/**
+   Storage that lasts until the command is finished.
+   Each thread has its own: see stash_pool_run()
+*/
+extern __thread arena stash_arena;
+
+/** Zeroed memory from stash_arena: never fails */
+void* stash_alloc(size_t n);
+
+/** Resize memory from stash_arena: never fails */
+void* stash_grow(void* p, size_t old, size_t n);
 
 bool stash_subcmd_lookup(const char* text, stash_subcmd* subcmd);
 
@@ -31,4 +47,50 @@ bool stash_push(const char* file, const char* hunk_ids);
 
 bool stash_pop(const char* text_file, const char* hunk_ids);
 
+/**
+   Push all hunks of many files with one svn diff
+   dir: The directory, or NULL for the current directory
+   changelist: Only files in this changelist, or NULL
+*/
+bool stash_push_tree(const char* dir, const char* changelist);
+
+/**
+   Pop all hunks of the stashes under dir,
+   or of the files in the changelist
+*/
+bool stash_pop_tree(const char* dir, const char* changelist);
+
+/**
+   Print the hunks in the stash of the file, from its index:
+   number, "@@" ranges, lines added and removed, bytes and checksum
+   format: "tsv" (the default if NULL) or "json" (one line per file)
+*/
+bool stash_list(const char* text_file, const char* format);
+
+/** Print the hunks of all stashes under dir, as stash_list() */
+bool stash_list_tree(const char* dir, const char* format);
+
+/**
+   Print the message and exit, or if stash_abort_jump is set,
+   record it in stash_error and jump there
+*/
 void stash_abort(const char* fmt, ...);
+
+/**
+   Set by libstash around each call: the call then fails instead of
+   exiting the process, though it may leak memory and descriptors.
+   Worker threads of tree commands still exit.
+*/
+extern __thread jmp_buf* stash_abort_jump;
+
+/**
+   If set, interactive mode asks this function instead of the terminal
+   number: The hunk number, from 1
+   choices: The keys it may return, as in the terminal prompt:
+            "sdkq" to push, "pdkq" to pop
+*/
+typedef int (*stash_prompt_function)(void* data, int number,
+                                     const char* hunk, size_t length,
+                                     const char* choices);
+extern __thread stash_prompt_function stash_prompt;
+extern __thread void* stash_prompt_data;
@@ -0,0 +1,202 @@
+/*
+ * stash_base.c
+ *
+ *  Access to the BASE revision of a working file
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "buffer.h"
+#include "stash.h"
+#include "stash_base.h"
+#include "stash_exec.h"
+#include "stash_log.h"
+#include "stash_wc.h"
+#include "util.h"
+
+/** Map base->pristine */
+static bool
+map_pristine(stash_base* base)
+{
+  const char* pristine = base->pristine;
+  int fd = open(pristine, O_RDONLY);
+  if (fd == -1)
+  {
+    stash_log(STASH_DEBUG, "could not open pristine: %s", pristine);
+    return false;
+  }
+  struct stat s;
+  int rc = fstat(fd, &s);
+  if (rc != 0)
+  {
+    close(fd);
+    return false;
+  }
+  base->length = s.st_size;
+  base->mapped = true;
+  base->data   = NULL;
+  if (base->length > 0)
+  {
+    void* p = mmap(NULL, base->length, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (p == MAP_FAILED)
+    {
+      close(fd);
+      return false;
+    }
+    base->data = p;
+  }
+  close(fd);
+  stash_log(STASH_DEBUG, "BASE text: %s", pristine);
+  return true;
+}
+
+/** Map the pristine text: no subprocess */
+static bool
+base_pristine(const char* text_name, stash_base* base)
+{
+  stash_wc_node node;
+  if (!stash_wc_lookup(text_name, &node))
+    return false;
+  if (node.translated)
+  {
+    stash_log(STASH_DEBUG, "svn translates: %s", text_name);
+    return false;
+  }
+  stash_wc_pristine(&node, base->pristine);
+  return map_pristine(base);
+}
+
+static bool
+base_svn_cat(const char* text_name, stash_base* base)
+{
+  const char* argv[] =
+    { "svn", "cat", "-r", "BASE", "--", text_name, NULL };
+  stash_exec E;
+  if (!stash_exec_spawn(&E, argv, STASH_EXEC_PIPE|STASH_EXEC_QUIET))
+    return false;
+
+  buffer B;
+  buffer_init(&B, 64*1024);
+  char chunk[64*1024];
+  ssize_t actual;
+  while ((actual = read(E.fd, chunk, sizeof(chunk))) != 0)
+  {
+    if (actual < 0)
+    {
+      if (errno == EINTR) continue;
+      break;
+    }
+    if (!buffer_append_data(&B, chunk, (int) actual))
+      stash_abort("Failed to allocate memory!");
+  }
+
+  bool b = stash_exec_wait(&E, NULL);
+  if (!b || actual < 0)
+  {
+    stash_log(STASH_DEBUG, "no BASE text for: %s", text_name);
+    buffer_finalize(&B);
+    return false;
+  }
+  base->data   = B.data;
+  base->length = B.length;
+  base->mapped = false;
+  base->pristine[0] = '\0';
+  return true;
+}
+
+bool
+stash_base_local(const char* text_name)
+{
+  stash_wc_node node;
+  if (!stash_wc_lookup(text_name, &node) || node.translated)
+    return false;
+  char pristine[path_max*2];
+  stash_wc_pristine(&node, pristine);
+  return access(pristine, R_OK) == 0;
+}
+
+bool
+stash_base_open_local(const char* text_name, stash_base* base)
+{
+  base->data   = NULL;
+  base->mapped = false;
+  if (base_pristine(text_name, base))
+    return true;
+  stash_base_close(base);
+  base->mapped = false;
+  return false;
+}
+
+bool
+stash_base_open(const char* text_name, stash_base* base)
+{
+  if (base_pristine(text_name, base))
+    return true;
+  return base_svn_cat(text_name, base);
+}
+
+bool
+stash_base_restore(const stash_base* base, const char* text_name)
+{
+  bool result = true;
+  stash_log(STASH_DEBUG, "restoring BASE text: %s", text_name);
+  char target[path_max];
+  stash_file tmp;
+  bool b = stash_file_temp_replace(&tmp, "text", text_name, target);
+  if (!b) return false;
+  int fd = -1;
+  if (base->mapped)
+    fd = open(base->pristine, O_RDONLY);
+  if (fd != -1)
+    b = stash_file_clone(&tmp, fd, base->length);
+  else
+    b = (base->length == 0 ||
+         (stash_file_fdopen(&tmp, "w") &&
+          fwrite(base->data, 1, base->length, tmp.fp) == base->length));
+  if (fd != -1) close(fd);
+  CHECK_GOTO(b, failed, "could not write: %s", text_name);
+  return stash_file_temp_commit(&tmp, target);
+
+  failed:
+  stash_temp_delete(&tmp);
+  return result;
+}
+
+bool
+stash_base_dup(const stash_base* base, stash_base* copy)
+{
+  // Pristines are named by their content: they never change
+  if (base->mapped)
+  {
+    strcpy(copy->pristine, base->pristine);
+    return map_pristine(copy);
+  }
+  copy->data = malloc(base->length+1);
+  if (copy->data == NULL)
+    stash_abort("Failed to allocate memory!");
+  memcpy(copy->data, base->data, base->length);
+  copy->length = base->length;
+  copy->mapped = false;
+  copy->pristine[0] = '\0';
+  return true;
+}
+
+void
+stash_base_close(stash_base* base)
+{
+  if (base->mapped)
+  {
+    if (base->data != NULL)
+      munmap(base->data, base->length);
+  }
+  else
+    free(base->data);
+  base->data = NULL;
+}
@@ -0,0 +1,49 @@
+/*
+ * stash_base.h
+ *
+ *  Access to the BASE revision of a working file
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "util.h"
+
+typedef struct
+{
+  char* data;
+  size_t length;
+  /** True if data is mapped from the pristine store */
+  bool mapped;
+  /** The pristine file, if mapped */
+  char pristine[path_max*2];
+} stash_base;
+
+/**
+   Get the BASE text of the working file: mapped from the
+   pristine store if possible, else from svn cat
+   @return False if there is no BASE text, quietly
+ */
+bool stash_base_open(const char* text_name, stash_base* base);
+
+/**
+   Map the BASE text from the pristine store: never runs svn
+   @return False if it is not there, with base->data NULL
+ */
+bool stash_base_open_local(const char* text_name, stash_base* base);
+
+/** @return True if the BASE text is in the pristine store */
+bool stash_base_local(const char* text_name);
+
+/**
+   Replace the working file with the BASE text,
+   sharing the pristine's blocks if the file system can
+*/
+bool stash_base_restore(const stash_base* base, const char* text_name);
+
+/** Copy the BASE text, or map the pristine again */
+bool stash_base_dup(const stash_base* base, stash_base* copy);
+
+void stash_base_close(stash_base* base);
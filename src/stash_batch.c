@@ -0,0 +1,119 @@
+/*
+ * stash_batch.c
+ *
+ *  Commands run one at a time in the calling thread.
+ *  The cache of stash serve is enabled, and its inotify events
+ *  are read before each command, so a command sees the changes
+ *  made by the commands before it.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "stash.h"
+#include "stash_batch.h"
+#include "stash_cache.h"
+#include "util.h"
+
+/**
+   Split the line into arguments, in place
+   argv: OUT: In stash_arena, with argv[0] = "stash"
+   @return False if a quote is not closed
+*/
+static bool
+split_line(char* line, int* argc, char*** argv)
+{
+  // An argument and its blank take at least two characters
+  char** A = stash_alloc((strlen(line)/2 + 3) * sizeof(char*));
+  A[0] = "stash";
+  int c = 1;
+  // Read at p, write at q: q never passes p
+  char* p = line;
+  char* q = line;
+  while (true)
+  {
+    p += strspn(p, " \t");
+    if (*p == '\0') break;
+    A[c++] = q;
+    bool quoted = false;
+    while (*p != '\0' && (quoted || (*p != ' ' && *p != '\t')))
+    {
+      if (*p == '"')
+      {
+        quoted = !quoted;
+        p++;
+      }
+      else if (*p == '\\' && p[1] != '\0')
+      {
+        *q++ = p[1];
+        p += 2;
+      }
+      else
+        *q++ = *p++;
+    }
+    if (quoted) return false;
+    bool end = (*p == '\0');
+    *q++ = '\0';
+    if (end) break;
+    p++;
+  }
+  A[c] = NULL;
+  *argc = c;
+  *argv = A;
+  return true;
+}
+
+/** Write the result line, with the error on one line */
+static void
+report(FILE* output, int number, int status, const char* error)
+{
+  fprintf(output, "%i\t%s\t", number,
+          status == EXIT_SUCCESS ? "ok" : "failed");
+  size_t n = strlen(error);
+  while (n > 0 && (error[n-1] == '\n' || error[n-1] == ' '))
+    n--;
+  for (size_t i = 0; i < n; i++)
+    fputc(error[i] == '\t' || error[i] == '\n' ? ' ' : error[i],
+          output);
+  fputc('\n', output);
+  // The caller may be waiting for it
+  fflush(output);
+}
+
+bool
+stash_batch(FILE* input, FILE* output, stash_batch_handler handler)
+{
+  stash_cache_start();
+  bool result = true;
+  char* line = NULL;
+  size_t size = 0;
+  ssize_t n;
+  int number = 0;
+  while ((n = getline(&line, &size, input)) != -1)
+  {
+    number++;
+    while (n > 0 && (line[n-1] == '\n' || line[n-1] == '\r'))
+      line[--n] = '\0';
+    char* command = line + strspn(line, " \t");
+    if (*command == '\0' || *command == '#') continue;
+
+    arena_mark mark = arena_save(&stash_arena);
+    int argc;
+    char** argv;
+    const char* error = "";
+    int status = EXIT_FAILURE;
+    if (!split_line(command, &argc, &argv))
+      error = "no closing quote";
+    else
+    {
+      stash_cache_events();
+      status = handler(argc, argv, &error);
+    }
+    if (status != EXIT_SUCCESS) result = false;
+    report(output, number, status, error);
+    arena_restore(&stash_arena, mark);
+  }
+  free(line);
+  stash_cache_finalize();
+  return result;
+}
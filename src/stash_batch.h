@@ -0,0 +1,37 @@
+/*
+ * stash_batch.h
+ *
+ *  stash --batch: run many commands in one process,
+ *  so they share wc.db, BASE texts and hunks.
+ *
+ *  The input has one command per line, written like the
+ *  arguments after "stash", e.g., "push file.c 1,3-5" or
+ *  "pop -F 0 file.c @".  Arguments are split at blanks;
+ *  an argument in double quotes may hold blanks,
+ *  and backslash quotes the next character.
+ *  Blank lines and lines starting with '#' are skipped.
+ *
+ *  For each command, one line is written to the output,
+ *  as soon as the command is done: the line number, a tab,
+ *  "ok" or "failed", a tab, and the error, if any.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdio.h>
+
+/**
+   Run one command, like main()
+   error: OUT: The error if it failed, else ""
+   @return The exit status
+*/
+typedef int (*stash_batch_handler)(int argc, char* argv[],
+                                   const char** error);
+
+/**
+   Run the commands in input until EOF
+   @return False if any command failed
+*/
+bool stash_batch(FILE* input, FILE* output,
+                 stash_batch_handler handler);
@@ -0,0 +1,397 @@
+/*
+ * stash_cache.c
+ *
+ *  Entries are keyed by the real path of the working file.
+ *  inotify watches the directory of each file, since stash replaces
+ *  files by rename, and the .svn directory of its working copy.
+ *  The status of the file is checked too, so an event not yet read
+ *  cannot leave stale hunks in use.
+ */
+
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+
+#include "stash.h"
+#include "stash_cache.h"
+#include "stash_log.h"
+#include "stash_wc.h"
+#include "util.h"
+
+#define CACHE_MAX 1024
+
+typedef struct
+{
+  /** The real path of the working file */
+  char path[path_max];
+  /** The working file when the hunks were found */
+  struct stat stamp;
+  bool has_hunks;
+  char* data;
+  size_t length;
+  stash_hunk* hunk;
+  int count;
+  stash_hunks_file* file;
+  int files;
+  bool has_base;
+  stash_base base;
+  /** For eviction: the least recently used goes first */
+  unsigned long used;
+} cache_entry;
+
+typedef struct
+{
+  int wd;
+  char dir[path_max];
+} cache_watch;
+
+static bool enabled = false;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static int inotify_fd = -1;
+static cache_entry* entries[CACHE_MAX];
+static int count = 0;
+static unsigned long ticks = 0;
+static cache_watch* watches = NULL;
+static int watch_count = 0;
+static int watch_capacity = 0;
+
+static const uint32_t watch_events =
+  IN_MODIFY|IN_CLOSE_WRITE|IN_CREATE|IN_DELETE|
+  IN_MOVED_FROM|IN_MOVED_TO;
+
+int
+stash_cache_start()
+{
+  inotify_fd = inotify_init1(IN_NONBLOCK|IN_CLOEXEC);
+  if (inotify_fd == -1)
+    stash_abort("could not start inotify: %s", strerror(errno));
+  enabled = true;
+  return inotify_fd;
+}
+
+static void
+drop_hunks(cache_entry* E)
+{
+  if (!E->has_hunks) return;
+  free(E->data);
+  free(E->hunk);
+  free(E->file);
+  E->data = NULL;
+  E->hunk = NULL;
+  E->file = NULL;
+  E->has_hunks = false;
+}
+
+static void
+drop_base(cache_entry* E)
+{
+  if (!E->has_base) return;
+  stash_base_close(&E->base);
+  E->has_base = false;
+}
+
+static void
+drop_entry(int i)
+{
+  drop_hunks(entries[i]);
+  drop_base(entries[i]);
+  free(entries[i]);
+  entries[i] = entries[--count];
+}
+
+static void
+drop_all(void)
+{
+  while (count > 0)
+    drop_entry(count-1);
+}
+
+static cache_entry*
+find(const char* path)
+{
+  for (int i = 0; i < count; i++)
+    if (strcmp(entries[i]->path, path) == 0)
+    {
+      entries[i]->used = ++ticks;
+      return entries[i];
+    }
+  return NULL;
+}
+
+static cache_entry*
+find_or_add(const char* path)
+{
+  cache_entry* E = find(path);
+  if (E != NULL) return E;
+  if (count == CACHE_MAX)
+  {
+    int oldest = 0;
+    for (int i = 1; i < count; i++)
+      if (entries[i]->used < entries[oldest]->used)
+        oldest = i;
+    drop_entry(oldest);
+  }
+  E = calloc(1, sizeof(cache_entry));
+  if (E == NULL) stash_abort("Failed to allocate memory!");
+  strcpy(E->path, path);
+  E->used = ++ticks;
+  entries[count++] = E;
+  return E;
+}
+
+static void
+watch(const char* dir)
+{
+  int wd = inotify_add_watch(inotify_fd, dir, watch_events);
+  if (wd == -1)
+  {
+    stash_log(STASH_DEBUG, "could not watch: %s: %s",
+              dir, strerror(errno));
+    return;
+  }
+  for (int i = 0; i < watch_count; i++)
+    if (watches[i].wd == wd)
+      return;
+  if (watch_count == watch_capacity)
+  {
+    watch_capacity = watch_capacity == 0 ? 16 : watch_capacity*2;
+    watches = realloc(watches, watch_capacity * sizeof(cache_watch));
+    if (watches == NULL) stash_abort("Failed to allocate memory!");
+  }
+  watches[watch_count].wd = wd;
+  strcpy(watches[watch_count].dir, dir);
+  watch_count++;
+}
+
+/** Watch the directory of the file, and its wc.db */
+static void
+watch_file(const char* path)
+{
+  char dir[path_max];
+  strcpy(dir, path);
+  char* slash = strrchr(dir, '/');
+  if (slash == NULL) return;
+  *slash = '\0';
+  watch(slash == dir ? "/" : dir);
+  char root[path_max], relpath[path_max];
+  if (stash_wc_root(path, root, relpath))
+  {
+    strcat(root, "/.svn");
+    watch(root);
+  }
+}
+
+static const char*
+watch_dir(int wd)
+{
+  for (int i = 0; i < watch_count; i++)
+    if (watches[i].wd == wd)
+      return watches[i].dir;
+  return NULL;
+}
+
+static void
+unwatch(int wd)
+{
+  for (int i = 0; i < watch_count; i++)
+    if (watches[i].wd == wd)
+    {
+      watches[i] = watches[--watch_count];
+      return;
+    }
+}
+
+static void
+event(const struct inotify_event* e)
+{
+  if (e->mask & IN_Q_OVERFLOW)
+  {
+    stash_log(STASH_DEBUG, "cache: events lost: clearing");
+    drop_all();
+    return;
+  }
+  if (e->mask & IN_IGNORED)
+  {
+    unwatch(e->wd);
+    return;
+  }
+  const char* dir = watch_dir(e->wd);
+  if (dir == NULL || e->len == 0) return;
+  size_t n = strlen(dir);
+  if (strncmp(e->name, "wc.db", 5) == 0 &&
+      n >= 5 && strcmp(dir+n-5, "/.svn") == 0)
+  {
+    // An update or commit may change any BASE text
+    stash_log(STASH_DEBUG, "cache: working copy changed: %s", dir);
+    drop_all();
+    return;
+  }
+  char path[path_max*2];
+  sprintf(path, "%s/%s", strcmp(dir, "/") == 0 ? "" : dir, e->name);
+  cache_entry* E = find(path);
+  if (E != NULL && E->has_hunks)
+  {
+    stash_log(STASH_TRACE, "cache: changed: %s", path);
+    drop_hunks(E);
+  }
+}
+
+void
+stash_cache_events()
+{
+  if (!enabled) return;
+  char buffer[64*1024]
+    __attribute__ ((aligned(__alignof__(struct inotify_event))));
+  pthread_mutex_lock(&lock);
+  while (true)
+  {
+    ssize_t n = read(inotify_fd, buffer, sizeof(buffer));
+    if (n <= 0) break;
+    for (char* p = buffer; p < buffer + n; )
+    {
+      const struct inotify_event* e = (const struct inotify_event*) p;
+      event(e);
+      p += sizeof(struct inotify_event) + e->len;
+    }
+  }
+  pthread_mutex_unlock(&lock);
+}
+
+static bool
+same_file(const struct stat* s1, const struct stat* s2)
+{
+  return s1->st_ino             == s2->st_ino            &&
+         s1->st_dev             == s2->st_dev            &&
+         s1->st_size            == s2->st_size           &&
+         s1->st_mtim.tv_sec     == s2->st_mtim.tv_sec    &&
+         s1->st_mtim.tv_nsec    == s2->st_mtim.tv_nsec;
+}
+
+/** Copy the cached hunks: the text is malloc'd, the arrays are in
+    stash_arena, as they are for hunks that were just found */
+static void
+copy_hunks(const cache_entry* E, stash_hunks* H)
+{
+  stash_hunks_init(H);
+  H->data = malloc(E->length+1);
+  if (H->data == NULL) stash_abort("Failed to allocate memory!");
+  memcpy(H->data, E->data, E->length);
+  H->length = H->capacity = E->length;
+  H->hunk = stash_alloc(E->count * sizeof(stash_hunk));
+  memcpy(H->hunk, E->hunk, E->count * sizeof(stash_hunk));
+  H->count = H->hunk_capacity = H->live = E->count;
+  if (E->files > 0)
+  {
+    H->file = stash_alloc(E->files * sizeof(stash_hunks_file));
+    memcpy(H->file, E->file, E->files * sizeof(stash_hunks_file));
+  }
+  H->files = H->file_capacity = E->files;
+  H->scan = H->start = E->length;
+}
+
+static void*
+dup_data(const void* data, size_t length)
+{
+  void* result = malloc(length+1);
+  if (result == NULL) stash_abort("Failed to allocate memory!");
+  if (length > 0) memcpy(result, data, length);
+  return result;
+}
+
+bool
+stash_cache_hunks(const char* text_name, stash_hunks* hunks,
+                  stash_base* base)
+{
+  base->data   = NULL;
+  base->mapped = false;
+  if (!enabled) return false;
+  char path[path_max];
+  struct stat s;
+  if (realpath(text_name, path) == NULL || stat(path, &s) != 0)
+    return false;
+  bool result = false;
+  pthread_mutex_lock(&lock);
+  cache_entry* E = find(path);
+  if (E == NULL || !E->has_hunks) goto done;
+  if (!same_file(&E->stamp, &s))
+  {
+    drop_hunks(E);
+    goto done;
+  }
+  if (E->has_base && !stash_base_dup(&E->base, base))
+  {
+    base->data   = NULL;
+    base->mapped = false;
+  }
+  copy_hunks(E, hunks);
+  stash_log(STASH_DEBUG, "cache: hunks of: %s", path);
+  result = true;
+
+  done:
+  pthread_mutex_unlock(&lock);
+  return result;
+}
+
+bool
+stash_cache_base(const char* text_name, stash_base* base)
+{
+  if (!enabled) return false;
+  char path[path_max];
+  if (realpath(text_name, path) == NULL)
+    return false;
+  bool result = false;
+  pthread_mutex_lock(&lock);
+  cache_entry* E = find(path);
+  if (E != NULL && E->has_base)
+    result = stash_base_dup(&E->base, base);
+  pthread_mutex_unlock(&lock);
+  if (result)
+    stash_log(STASH_DEBUG, "cache: BASE text of: %s", path);
+  return result;
+}
+
+void
+stash_cache_store(const char* text_name, const stash_hunks* hunks,
+                  const stash_base* base)
+{
+  if (!enabled) return;
+  char path[path_max];
+  struct stat s;
+  if (realpath(text_name, path) == NULL || stat(path, &s) != 0)
+    return;
+  pthread_mutex_lock(&lock);
+  cache_entry* E = find_or_add(path);
+  drop_hunks(E);
+  E->stamp  = s;
+  E->data   = dup_data(hunks->data, hunks->length);
+  E->length = hunks->length;
+  E->hunk   = dup_data(hunks->hunk, hunks->count * sizeof(stash_hunk));
+  E->count  = hunks->count;
+  E->file   = dup_data(hunks->file,
+                       hunks->files * sizeof(stash_hunks_file));
+  E->files  = hunks->files;
+  E->has_hunks = true;
+  if (base != NULL && !E->has_base &&
+      (base->data != NULL || base->mapped))
+    E->has_base = stash_base_dup(base, &E->base);
+  watch_file(path);
+  pthread_mutex_unlock(&lock);
+}
+
+void
+stash_cache_finalize()
+{
+  if (!enabled) return;
+  drop_all();
+  free(watches);
+  watches = NULL;
+  watch_count = watch_capacity = 0;
+  close(inotify_fd);
+  inotify_fd = -1;
+  enabled = false;
+}
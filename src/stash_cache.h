@@ -0,0 +1,45 @@
+/*
+ * stash_cache.h
+ *
+ *  In-memory cache of BASE texts and hunks for stash serve.
+ *  Entries are dropped when inotify reports a change to the file,
+ *  or to the wc.db of its working copy.
+ *  Disabled unless stash_cache_start() is called.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+
+#include "stash_base.h"
+#include "stash_hunks.h"
+
+/**
+   Enable the cache
+   @return The inotify file descriptor, to poll for events
+*/
+int stash_cache_start(void);
+
+/** Read the pending inotify events, dropping stale entries */
+void stash_cache_events(void);
+
+/**
+   Get the hunks of the file, if they are cached and the file
+   has not changed since
+   base: OUT: The BASE text, if cached, else its data is NULL
+   @return False if the hunks are not cached
+*/
+bool stash_cache_hunks(const char* text_name, stash_hunks* hunks,
+                       stash_base* base);
+
+/** @return False if the BASE text of the file is not cached */
+bool stash_cache_base(const char* text_name, stash_base* base);
+
+/**
+   Cache the hunks of the file as it is now
+   base: The BASE text they were diffed against: may be NULL
+*/
+void stash_cache_store(const char* text_name, const stash_hunks* hunks,
+                       const stash_base* base);
+
+void stash_cache_finalize(void);
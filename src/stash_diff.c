@@ -0,0 +1,467 @@
+/*
+ * stash_diff.c
+ *
+ *  In-process line diff.
+ *  Lines are interned to integers, then the texts are split
+ *  at lines unique to both sides (patience diff), and the
+ *  segments between them are diffed with Myers' algorithm
+ *  in linear space.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "stash.h"
+#include "stash_diff.h"
+#include "stash_log.h"
+#include "stash_patch.h"
+
+typedef struct
+{
+  /** Line ids */
+  int* a;
+  int* b;
+  /** Output: lines deleted from a, inserted into b */
+  char* del;
+  char* ins;
+  /** Number of distinct lines */
+  int ids;
+  /** Per-id scratch space for the patience step */
+  int* count_a;
+  int* count_b;
+  int* where_a;
+  int* where_b;
+  /** Storage for all of the above and for temporaries */
+  arena scratch;
+  /** Where the texts start in the whole files, for the headers */
+  int old_line;
+  int new_line;
+} diff_ctx;
+
+/** Zeroed scratch space */
+static void*
+scratch(diff_ctx* ctx, size_t n)
+{
+  void* result = arena_calloc(&ctx->scratch, n);
+  if (result == NULL)
+    stash_abort("Failed to allocate memory!");
+  return result;
+}
+
+static inline uint64_t
+line_hash(const stash_line* line)
+{
+  uint64_t h = 14695981039346656037ULL;
+  const unsigned char* p = (const unsigned char*) line->data;
+  for (size_t i = 0; i < line->length; i++)
+  {
+    h ^= p[i];
+    h *= 1099511628211ULL;
+  }
+  return h;
+}
+
+typedef struct
+{
+  uint64_t hash;
+  const stash_line* line;
+  int id;
+} intern_slot;
+
+/** Give equal lines equal ids */
+static void
+intern(diff_ctx* ctx, stash_line* A, int n, stash_line* B, int m)
+{
+  size_t size = 64;
+  while (size < 2 * (size_t)(n+m)) size *= 2;
+  arena_mark mark = arena_save(&ctx->scratch);
+  intern_slot* table = scratch(ctx, size * sizeof(intern_slot));
+  ctx->ids = 0;
+  for (int side = 0; side < 2; side++)
+  {
+    stash_line* L   = side == 0 ? A : B;
+    int         k   = side == 0 ? n : m;
+    int*        out = side == 0 ? ctx->a : ctx->b;
+    for (int i = 0; i < k; i++)
+    {
+      uint64_t h = line_hash(&L[i]);
+      size_t s = h & (size-1);
+      while (true)
+      {
+        if (table[s].line == NULL)
+        {
+          table[s].hash = h;
+          table[s].line = &L[i];
+          table[s].id   = ctx->ids++;
+          break;
+        }
+        if (table[s].hash == h &&
+            table[s].line->length == L[i].length &&
+            memcmp(table[s].line->data, L[i].data, L[i].length) == 0)
+          break;
+        s = (s+1) & (size-1);
+      }
+      out[i] = table[s].id;
+    }
+  }
+  arena_restore(&ctx->scratch, mark);
+}
+
+static void
+mark(diff_ctx* ctx, int a0, int a1, int b0, int b1)
+{
+  memset(ctx->del+a0, 1, (size_t)(a1-a0));
+  memset(ctx->ins+b0, 1, (size_t)(b1-b0));
+}
+
+/** Narrow the segment to exclude its common prefix and suffix */
+static void
+trim(diff_ctx* ctx, int* a0, int* a1, int* b0, int* b1)
+{
+  while (*a0 < *a1 && *b0 < *b1 && ctx->a[*a0] == ctx->b[*b0])
+  { (*a0)++; (*b0)++; }
+  while (*a0 < *a1 && *b0 < *b1 && ctx->a[*a1-1] == ctx->b[*b1-1])
+  { (*a1)--; (*b1)--; }
+}
+
+static void myers(diff_ctx* ctx, int a0, int a1, int b0, int b1);
+
+/**
+   Find the middle of the shortest edit script and recurse
+   on both sides of it.  After Myers (1986) section 4b.
+ */
+static void
+bisect(diff_ctx* ctx, int a0, int a1, int b0, int b1)
+{
+  const int* A = ctx->a + a0;
+  const int* B = ctx->b + b0;
+  int N = a1-a0, M = b1-b0;
+  int max_d = (N+M+1) / 2;
+  int offset = max_d;
+  int length = 2*max_d + 2;
+  arena_mark m = arena_save(&ctx->scratch);
+  int* v1 = scratch(ctx, 2 * (size_t) length * sizeof(int));
+  int* v2 = v1 + length;
+  for (int i = 0; i < length; i++)
+    v1[i] = v2[i] = -1;
+  v1[offset+1] = 0;
+  v2[offset+1] = 0;
+  int delta = N - M;
+  // If the total number of lines is odd, the front path
+  // will collide with the reverse path
+  bool front = (delta % 2 != 0);
+  int k1start = 0, k1end = 0, k2start = 0, k2end = 0;
+  for (int d = 0; d < max_d; d++)
+  {
+    for (int k1 = -d + k1start; k1 <= d - k1end; k1 += 2)
+    {
+      int k1_offset = offset + k1;
+      int x1;
+      if (k1 == -d || (k1 != d && v1[k1_offset-1] < v1[k1_offset+1]))
+        x1 = v1[k1_offset+1];
+      else
+        x1 = v1[k1_offset-1] + 1;
+      int y1 = x1 - k1;
+      while (x1 < N && y1 < M && A[x1] == B[y1])
+      { x1++; y1++; }
+      v1[k1_offset] = x1;
+      if (x1 > N)
+        k1end += 2;
+      else if (y1 > M)
+        k1start += 2;
+      else if (front)
+      {
+        int k2_offset = offset + delta - k1;
+        if (k2_offset >= 0 && k2_offset < length &&
+            v2[k2_offset] != -1)
+        {
+          int x2 = N - v2[k2_offset];
+          if (x1 >= x2)
+          {
+            arena_restore(&ctx->scratch, m);
+            myers(ctx, a0, a0+x1, b0, b0+y1);
+            myers(ctx, a0+x1, a1, b0+y1, b1);
+            return;
+          }
+        }
+      }
+    }
+    for (int k2 = -d + k2start; k2 <= d - k2end; k2 += 2)
+    {
+      int k2_offset = offset + k2;
+      int x2;
+      if (k2 == -d || (k2 != d && v2[k2_offset-1] < v2[k2_offset+1]))
+        x2 = v2[k2_offset+1];
+      else
+        x2 = v2[k2_offset-1] + 1;
+      int y2 = x2 - k2;
+      while (x2 < N && y2 < M && A[N-x2-1] == B[M-y2-1])
+      { x2++; y2++; }
+      v2[k2_offset] = x2;
+      if (x2 > N)
+        k2end += 2;
+      else if (y2 > M)
+        k2start += 2;
+      else if (!front)
+      {
+        int k1_offset = offset + delta - k2;
+        if (k1_offset >= 0 && k1_offset < length &&
+            v1[k1_offset] != -1)
+        {
+          int x1 = v1[k1_offset];
+          int y1 = offset + x1 - k1_offset;
+          if (x1 >= N - x2)
+          {
+            arena_restore(&ctx->scratch, m);
+            myers(ctx, a0, a0+x1, b0, b0+y1);
+            myers(ctx, a0+x1, a1, b0+y1, b1);
+            return;
+          }
+        }
+      }
+    }
+  }
+  arena_restore(&ctx->scratch, m);
+  // Nothing in common
+  mark(ctx, a0, a1, b0, b1);
+}
+
+static void
+myers(diff_ctx* ctx, int a0, int a1, int b0, int b1)
+{
+  trim(ctx, &a0, &a1, &b0, &b1);
+  if (a0 == a1 || b0 == b1)
+    mark(ctx, a0, a1, b0, b1);
+  else
+    bisect(ctx, a0, a1, b0, b1);
+}
+
+static void segment(diff_ctx* ctx, int a0, int a1, int b0, int b1);
+
+/**
+   Match lines that occur exactly once on each side,
+   keep the longest increasing run of such matches,
+   and diff the gaps between them
+   @return False if there are no such lines
+ */
+static bool
+patience(diff_ctx* ctx, int a0, int a1, int b0, int b1)
+{
+  bool result = false;
+  bool common = false;
+  for (int i = a0; i < a1; i++)
+  {
+    ctx->count_a[ctx->a[i]]++;
+    ctx->where_a[ctx->a[i]] = i;
+  }
+  for (int j = b0; j < b1; j++)
+  {
+    ctx->count_b[ctx->b[j]]++;
+    ctx->where_b[ctx->b[j]] = j;
+  }
+
+  // Candidate matches in order of a, and their positions in b
+  int n = 0;
+  arena_mark m = arena_save(&ctx->scratch);
+  int* match_a = scratch(ctx, (size_t)(a1-a0) * 4 * sizeof(int));
+  int* match_b = match_a + (a1-a0);
+  int* tails   = match_b + (a1-a0);
+  int* prev    = tails   + (a1-a0);
+  for (int i = a0; i < a1; i++)
+  {
+    int id = ctx->a[i];
+    if (ctx->count_b[id] > 0) common = true;
+    if (ctx->count_a[id] == 1 && ctx->count_b[id] == 1)
+    {
+      match_a[n] = i;
+      match_b[n] = ctx->where_b[id];
+      n++;
+    }
+  }
+
+  for (int i = a0; i < a1; i++) ctx->count_a[ctx->a[i]] = 0;
+  for (int j = b0; j < b1; j++) ctx->count_b[ctx->b[j]] = 0;
+
+  if (!common)
+  {
+    mark(ctx, a0, a1, b0, b1);
+    result = true;
+    goto done;
+  }
+  if (n == 0) goto done;
+
+  // Longest increasing subsequence of match_b by patience sorting
+  int piles = 0;
+  for (int k = 0; k < n; k++)
+  {
+    int lo = 0, hi = piles;
+    while (lo < hi)
+    {
+      int mid = (lo+hi) / 2;
+      if (match_b[tails[mid]] < match_b[k]) lo = mid+1;
+      else hi = mid;
+    }
+    prev[k] = lo > 0 ? tails[lo-1] : -1;
+    tails[lo] = k;
+    if (lo == piles) piles++;
+  }
+  // Walk the chain backwards, reusing tails for the anchors
+  int count = piles;
+  for (int k = tails[piles-1], c = count-1; k != -1; k = prev[k], c--)
+    tails[c] = k;
+
+  int i = a0, j = b0;
+  for (int c = 0; c < count; c++)
+  {
+    int k = tails[c];
+    segment(ctx, i, match_a[k], j, match_b[k]);
+    i = match_a[k] + 1;
+    j = match_b[k] + 1;
+  }
+  segment(ctx, i, a1, j, b1);
+  result = true;
+
+  done:
+  arena_restore(&ctx->scratch, m);
+  return result;
+}
+
+static void
+segment(diff_ctx* ctx, int a0, int a1, int b0, int b1)
+{
+  trim(ctx, &a0, &a1, &b0, &b1);
+  if (a0 == a1 || b0 == b1)
+  {
+    mark(ctx, a0, a1, b0, b1);
+    return;
+  }
+  if (!patience(ctx, a0, a1, b0, b1))
+    myers(ctx, a0, a1, b0, b1);
+}
+
+static void
+emit_line(stash_hunks* H, char marker, const stash_line* line)
+{
+  stash_hunks_put(H, &marker, 1);
+  stash_hunks_put(H, line->data, line->length);
+  if (line->length == 0 || line->data[line->length-1] != '\n')
+  {
+    const char* s = "\n\\ No newline at end of file\n";
+    stash_hunks_put(H, s, strlen(s));
+  }
+}
+
+static void
+emit_hunk(diff_ctx* ctx, stash_line* A, stash_line* B,
+          int i0, int i1, int j0, int j1, stash_hunks* H)
+{
+  size_t start = H->length;
+  int old_count = i1-i0, new_count = j1-j0;
+  char header[128];
+  int n = sprintf(header, "@@ -%i,%i +%i,%i @@\n",
+                  ctx->old_line + (old_count > 0 ? i0+1 : i0), old_count,
+                  ctx->new_line + (new_count > 0 ? j0+1 : j0), new_count);
+  stash_hunks_put(H, header, (size_t) n);
+  int i = i0, j = j0;
+  while (i < i1 || j < j1)
+  {
+    if (i < i1 && ctx->del[i])
+      emit_line(H, '-', &A[i++]);
+    else if (j < j1 && ctx->ins[j])
+      emit_line(H, '+', &B[j++]);
+    else
+    {
+      emit_line(H, ' ', &A[i]);
+      i++; j++;
+    }
+  }
+  stash_hunks_add(H, start, H->length - start);
+}
+
+/** Group the changes into hunks with context */
+static void
+emit_hunks(diff_ctx* ctx, stash_line* A, int n, stash_line* B, int m,
+           stash_hunks* H)
+{
+  const int C = STASH_DIFF_CONTEXT;
+  int i = 0, j = 0;
+  while (true)
+  {
+    while (i < n && j < m && !ctx->del[i] && !ctx->ins[j])
+    { i++; j++; }
+    if (i >= n && j >= m) break;
+    int before = i < C ? i : C;
+    int i0 = i - before, j0 = j - before;
+    int i1 = i, j1 = j;
+    while (true)
+    {
+      while (i < n && ctx->del[i]) i++;
+      while (j < m && ctx->ins[j]) j++;
+      int run = 0;
+      while (i+run < n && j+run < m &&
+             !ctx->del[i+run] && !ctx->ins[j+run])
+        run++;
+      bool end = (i+run >= n && j+run >= m);
+      if (end || run > 2*C)
+      {
+        int after = run < C ? run : C;
+        i1 = i + after;
+        j1 = j + after;
+        i += run;
+        j += run;
+        break;
+      }
+      i += run;
+      j += run;
+    }
+    emit_hunk(ctx, A, B, i0, i1, j0, j1, H);
+  }
+}
+
+bool
+stash_diff(const char* old, size_t old_length,
+           const char* new, size_t new_length,
+           stash_hunks* hunks)
+{
+  return stash_diff_at(old, old_length, 0, new, new_length, 0, hunks);
+}
+
+bool
+stash_diff_at(const char* old, size_t old_length, int old_line,
+              const char* new, size_t new_length, int new_line,
+              stash_hunks* hunks)
+{
+  stash_line* A = NULL;
+  stash_line* B = NULL;
+  int n, m, capacity_a = 0, capacity_b = 0;
+  stash_lines_split(old, old_length, &A, &n, &capacity_a);
+  stash_lines_split(new, new_length, &B, &m, &capacity_b);
+  stash_log(STASH_DEBUG, "diff: %i lines -> %i lines", n, m);
+
+  // All scratch space is released at once at the end
+  diff_ctx ctx;
+  arena_init(&ctx.scratch, 256*1024);
+  ctx.old_line = old_line;
+  ctx.new_line = new_line;
+  ctx.a   = scratch(&ctx, (size_t)(n+m) * sizeof(int));
+  ctx.b   = ctx.a + n;
+  ctx.del = scratch(&ctx, (size_t) n+1);
+  ctx.ins = scratch(&ctx, (size_t) m+1);
+  intern(&ctx, A, n, B, m);
+  ctx.count_a = scratch(&ctx, (size_t) ctx.ids * 4 * sizeof(int));
+  ctx.count_b = ctx.count_a + ctx.ids;
+  ctx.where_a = ctx.count_b + ctx.ids;
+  ctx.where_b = ctx.where_a + ctx.ids;
+
+  segment(&ctx, 0, n, 0, m);
+  int before = hunks->count;
+  emit_hunks(&ctx, A, n, B, m, hunks);
+  stash_log(STASH_DEBUG, "diff: %i hunks", hunks->count - before);
+
+  arena_finalize(&ctx.scratch);
+  free(A);
+  free(B);
+  return true;
+}
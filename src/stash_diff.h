@@ -0,0 +1,34 @@
+/*
+ * stash_diff.h
+ *
+ *  In-process line diff producing unified diff hunks
+ *  in the same form as svn diff
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "stash_hunks.h"
+
+/** Lines of context around each change, as svn diff */
+#define STASH_DIFF_CONTEXT 3
+
+/**
+   Compute the hunks that turn old into new
+   hunks: OUT: The hunk text is appended, and each hunk added
+ */
+bool stash_diff(const char* old, size_t old_length,
+                const char* new, size_t new_length,
+                stash_hunks* hunks);
+
+/**
+   As stash_diff(), for slices of two texts that start at
+   old_line and new_line (counting from 0) of the whole texts:
+   the hunk headers number the lines of the whole texts.
+   The slices must start and end at line boundaries.
+ */
+bool stash_diff_at(const char* old, size_t old_length, int old_line,
+                   const char* new, size_t new_length, int new_line,
+                   stash_hunks* hunks);
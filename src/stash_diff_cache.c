@@ -0,0 +1,580 @@
+/*
+ * stash_diff_cache.c
+ *
+ *  An entry is named by a hash of the real path of the working file,
+ *  and records that path, so a collision is only a miss.
+ *  To diff a large file again, the unchanged head and tail are
+ *  found by block hashes, and the cached hunks within them are kept
+ *  if they are far enough from the changed lines that a full diff
+ *  would not join them to a new hunk.  Only the lines between the
+ *  kept hunks are diffed, and the headers of the kept hunks after
+ *  them are renumbered.
+ */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE // for memrchr()
+#endif
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "stash.h"
+#include "stash_diff.h"
+#include "stash_diff_cache.h"
+#include "stash_file.h"
+#include "stash_log.h"
+#include "stash_patch.h"
+#include "stash_wc.h"
+#include "util.h"
+
+/** An entry, sliced */
+typedef struct
+{
+  const stash_diff_cache_header* header;
+  const char* path;
+  const uint64_t* head;
+  const uint64_t* tail;
+  /** Offset-length pairs */
+  const uint64_t* hunk;
+  const stash_diff_cache_file* file;
+  const char* data;
+} entry;
+
+static inline uint64_t
+align8(uint64_t n)
+{
+  return (n + 7) & ~(uint64_t) 7;
+}
+
+static bool
+cache_dir(char* output)
+{
+  char* dir;
+  int n;
+  if (getenv_string("XDG_CACHE_HOME", &dir))
+    n = snprintf(output, path_max, "%s/stash", dir);
+  else if (getenv_string("HOME", &dir))
+    n = snprintf(output, path_max, "%s/.cache/stash", dir);
+  else
+    return false;
+  return n < path_max;
+}
+
+/** @return False if the entry is damaged */
+static bool
+entry_slice(const char* map, size_t length, entry* E)
+{
+  const stash_diff_cache_header* H = (const void*) map;
+  if (length < sizeof(*H) ||
+      memcmp(H->magic, STASH_DIFF_CACHE_MAGIC, 8) != 0 ||
+      H->version != STASH_DIFF_CACHE_VERSION ||
+      H->path_length >= path_max ||
+      H->blocks > length || H->hunks > length || H->files > length ||
+      H->data_length > length)
+    return false;
+  uint64_t offset = sizeof(*H);
+  E->header = H;
+  E->path   = map + offset;
+  offset   += align8(H->path_length);
+  E->head   = (const void*) (map + offset);
+  offset   += H->blocks * sizeof(uint64_t);
+  E->tail   = (const void*) (map + offset);
+  offset   += H->blocks * sizeof(uint64_t);
+  E->hunk   = (const void*) (map + offset);
+  offset   += H->hunks * 2 * sizeof(uint64_t);
+  E->file   = (const void*) (map + offset);
+  offset   += H->files * sizeof(stash_diff_cache_file);
+  E->data   = map + offset;
+  offset   += H->data_length;
+  if (offset != length) return false;
+  for (uint64_t i = 0; i < H->hunks; i++)
+    if (E->hunk[2*i] > H->data_length ||
+        E->hunk[2*i+1] > H->data_length - E->hunk[2*i])
+      return false;
+  for (uint64_t i = 0; i < H->files; i++)
+    if (E->file[i].name > H->data_length ||
+        E->file[i].name_length > H->data_length - E->file[i].name)
+      return false;
+  return true;
+}
+
+void
+stash_diff_cache_open(stash_diff_cache* C, const char* text_name)
+{
+  C->valid = false;
+  C->map   = NULL;
+  char dir[path_max];
+  stash_wc_node node;
+  // A write after this has an mtime no older than this
+  C->stamped = time(NULL);
+  if (!cache_dir(dir) ||
+      realpath(text_name, C->path) == NULL ||
+      stat(C->path, &C->stamp) != 0 ||
+      !stash_wc_lookup(text_name, &node) || node.translated)
+    return;
+  strcpy(C->sha1, node.sha1);
+  uint64_t h = hash_data(C->path, strlen(C->path));
+  sprintf(C->name, "%s/%016llx.diff", dir, (unsigned long long) h);
+  C->valid = true;
+
+  int fd = open(C->name, O_RDONLY);
+  if (fd == -1) return;
+  struct stat s;
+  if (fstat(fd, &s) == 0 && s.st_size > 0)
+  {
+    void* p = mmap(NULL, s.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (p != MAP_FAILED)
+    {
+      C->map = p;
+      C->map_length = s.st_size;
+    }
+  }
+  close(fd);
+  if (C->map == NULL) return;
+
+  entry E;
+  size_t n = strlen(C->path);
+  if (!entry_slice(C->map, C->map_length, &E) ||
+      E.header->path_length != n ||
+      memcmp(E.path, C->path, n) != 0 ||
+      strcmp(E.header->sha1, C->sha1) != 0)
+  {
+    stash_log(STASH_DEBUG, "diff cache: no entry for: %s", C->path);
+    munmap(C->map, C->map_length);
+    C->map = NULL;
+  }
+}
+
+static bool
+same_file(const stash_diff_cache_header* H, const struct stat* s)
+{
+  return H->ino        == (uint64_t) s->st_ino          &&
+         H->dev        == (uint64_t) s->st_dev          &&
+         H->size       == (uint64_t) s->st_size         &&
+         H->mtime_sec  == (int64_t)  s->st_mtim.tv_sec  &&
+         H->mtime_nsec == (int64_t)  s->st_mtim.tv_nsec;
+}
+
+/**
+   Racily clean, as git calls it: the file was written in the second
+   it was stamped, so it may have been written again after it was
+   read, with the same size and mtime
+*/
+static bool
+racy(const stash_diff_cache_header* H)
+{
+  return H->mtime_sec >= H->stamped;
+}
+
+/** The text is malloc'd and the arrays are in stash_arena,
+    as they are for hunks that were just found */
+bool
+stash_diff_cache_hunks(stash_diff_cache* C, stash_hunks* hunks)
+{
+  if (C->map == NULL) return false;
+  entry E;
+  entry_slice(C->map, C->map_length, &E);
+  const stash_diff_cache_header* H = E.header;
+  if (!same_file(H, &C->stamp)) return false;
+  if (racy(H))
+  {
+    stash_log(STASH_DEBUG, "diff cache: racily clean: %s", C->path);
+    return false;
+  }
+
+  stash_hunks_init(hunks);
+  hunks->data = malloc(H->data_length+1);
+  if (hunks->data == NULL) stash_abort("Failed to allocate memory!");
+  memcpy(hunks->data, E.data, H->data_length);
+  hunks->length = hunks->capacity = H->data_length;
+  hunks->scan = hunks->start = H->data_length;
+  if (H->hunks > 0)
+    hunks->hunk = stash_alloc(H->hunks * sizeof(stash_hunk));
+  for (uint64_t i = 0; i < H->hunks; i++)
+  {
+    hunks->hunk[i].offset = E.hunk[2*i];
+    hunks->hunk[i].length = E.hunk[2*i+1];
+  }
+  hunks->count = hunks->hunk_capacity = hunks->live = (int) H->hunks;
+  if (H->files > 0)
+    hunks->file = stash_alloc(H->files * sizeof(stash_hunks_file));
+  for (uint64_t i = 0; i < H->files; i++)
+  {
+    hunks->file[i].name        = E.file[i].name;
+    hunks->file[i].name_length = E.file[i].name_length;
+    hunks->file[i].first       = (int) E.file[i].first;
+    hunks->file[i].count       = (int) E.file[i].count;
+  }
+  hunks->files = hunks->file_capacity = (int) H->files;
+  stash_log(STASH_DEBUG, "diff cache: hunks of: %s", C->path);
+  return true;
+}
+
+/** @return The end of k lines from p, or NULL if there are fewer */
+static const char*
+skip_lines(const char* p, const char* end, int k)
+{
+  for (int i = 0; i < k; i++)
+  {
+    if (p == end) return NULL;
+    const char* q = memchr(p, '\n', (size_t)(end-p));
+    p = (q == NULL) ? end : q+1;
+  }
+  return p;
+}
+
+/** @return The start of k lines before p, or NULL if there are fewer
+            after start */
+static const char*
+skip_lines_back(const char* start, const char* p, int k)
+{
+  for (int i = 0; i < k; i++)
+  {
+    if (p == start) return NULL;
+    // p-1 is the newline of the line before p, if it has one
+    const char* q = memrchr(start, '\n', (size_t)(p-1-start));
+    p = (q == NULL) ? start : q+1;
+  }
+  return p;
+}
+
+static int
+count_lines(const char* p, const char* end)
+{
+  int result = 0;
+  while (p < end)
+  {
+    const char* q = memchr(p, '\n', (size_t)(end-p));
+    p = (q == NULL) ? end : q+1;
+    result++;
+  }
+  return result;
+}
+
+/**
+   Hash the blocks of the text from each end
+   head, tail: OUT: Room for blocks hashes
+*/
+static void
+hash_blocks(const char* text, size_t length, int blocks,
+            uint64_t* head, uint64_t* tail)
+{
+  const int K = STASH_DIFF_CACHE_BLOCK;
+  const char* end = text + length;
+  const char* p = text;
+  for (int i = 0; i < blocks; i++)
+  {
+    const char* q = skip_lines(p, end, K);
+    head[i] = hash_data(p, (size_t)(q-p));
+    p = q;
+  }
+  p = end;
+  for (int i = 0; i < blocks; i++)
+  {
+    const char* q = skip_lines_back(text, p, K);
+    tail[i] = hash_data(q, (size_t)(p-q));
+    p = q;
+  }
+}
+
+/**
+   Match the blocks of the text to those of the entry
+   head, tail: OUT: The number of unchanged lines at each end
+*/
+static void
+match_blocks(const entry* E, const char* text, size_t length,
+             int* head, int* tail)
+{
+  const int K = STASH_DIFF_CACHE_BLOCK;
+  const char* end = text + length;
+  const char* p = text;
+  int i = 0;
+  for (; i < (int) E->header->blocks; i++)
+  {
+    const char* q = skip_lines(p, end, K);
+    if (q == NULL || hash_data(p, (size_t)(q-p)) != E->head[i])
+      break;
+    p = q;
+  }
+  *head = i*K;
+  // The ends must not overlap, in either text
+  const char* start = p;
+  int limit = ((int) E->header->lines - *head) / K;
+  if (limit > (int) E->header->blocks)
+    limit = (int) E->header->blocks;
+  p = end;
+  for (i = 0; i < limit; i++)
+  {
+    const char* q = skip_lines_back(start, p, K);
+    if (q == NULL || hash_data(q, (size_t)(p-q)) != E->tail[i])
+      break;
+    p = q;
+  }
+  *tail = i*K;
+}
+
+/** A hunk from stash_diff(), with lines counted from 0 */
+typedef struct
+{
+  int old_start, old_count;
+  int new_start, new_count;
+  /** Lines of context before the first change and after the last */
+  int lead, trail;
+} hunk_shape;
+
+static bool
+shape(const char* text, size_t length, hunk_shape* S)
+{
+  const char* end = text + length;
+  const char* p = memchr(text, '\n', length);
+  int a, b, c, d;
+  if (p == NULL || !stash_patch_header(text, length, &a, &b, &c, &d))
+    return false;
+  S->old_start = b > 0 ? a-1 : a;
+  S->old_count = b;
+  S->new_start = d > 0 ? c-1 : c;
+  S->new_count = d;
+  p++;
+  S->lead = 0;
+  while (p < end && *p == ' ')
+  {
+    S->lead++;
+    p = skip_lines(p, end, 1);
+  }
+  S->trail = 0;
+  const char* q = end;
+  while (q > p)
+  {
+    const char* r = skip_lines_back(p, q, 1);
+    if (*r == ' ')
+      S->trail++;
+    else if (*r != '\\')
+      break;
+    q = r;
+  }
+  return true;
+}
+
+/** Append a hunk, renumbering its new lines by delta */
+static void
+put_hunk(stash_hunks* H, const char* text, size_t length,
+         const hunk_shape* S, int delta)
+{
+  size_t start = H->length;
+  if (delta == 0)
+    stash_hunks_put(H, text, length);
+  else
+  {
+    const int n = S->new_start + delta;
+    char header[128];
+    int k = sprintf(header, "@@ -%i,%i +%i,%i @@\n",
+                    S->old_count > 0 ? S->old_start+1 : S->old_start,
+                    S->old_count,
+                    S->new_count > 0 ? n+1 : n, S->new_count);
+    const char* body = memchr(text, '\n', length) + 1;
+    stash_hunks_put(H, header, (size_t) k);
+    stash_hunks_put(H, body, length - (size_t)(body-text));
+  }
+  stash_hunks_add(H, start, H->length - start);
+}
+
+/**
+   Diff only the lines that changed since the entry was made
+   @return False if too little is unchanged: nothing is added
+*/
+static bool
+splice_hunks(const entry* E, const stash_base* base,
+       const char* text, size_t length, stash_hunks* hunks)
+{
+  const int C = STASH_DIFF_CONTEXT;
+  const stash_diff_cache_header* H = E->header;
+  const int n0 = (int) H->lines;
+  const int count = (int) H->hunks;
+  int head, tail;
+  match_blocks(E, text, length, &head, &tail);
+  if (head + tail == 0) return false;
+
+  hunk_shape* S = malloc((count+1) * sizeof(hunk_shape));
+  if (S == NULL) stash_abort("Failed to allocate memory!");
+  bool result = false;
+  for (int i = 0; i < count; i++)
+    if (!shape(E->data + E->hunk[2*i], E->hunk[2*i+1], &S[i]))
+    {
+      stash_log(STASH_DEBUG, "diff cache: bad hunk %i in: %.*s",
+                i+1, (int) H->path_length, E->path);
+      goto done;
+    }
+
+  // Keep hunks 0..k-1 at the head, and j..count-1 at the tail
+  int k = 0;
+  while (k < count &&
+         S[k].new_start + S[k].new_count <= head &&
+         S[k].new_start + S[k].new_count - S[k].trail + 2*C < head)
+    k++;
+  int j = count;
+  while (j > k &&
+         S[j-1].new_start >= n0 - tail &&
+         S[j-1].new_start + S[j-1].lead - (n0 - tail) > 2*C)
+    j--;
+
+  // The lines in between, in each text
+  int old0 = 0, new0 = 0;
+  if (k > 0)
+  {
+    old0 = S[k-1].old_start + S[k-1].old_count;
+    new0 = S[k-1].new_start + S[k-1].new_count;
+  }
+  const char* base_end = base->data + base->length;
+  const char* text_end = text + length;
+  const char* b0 = skip_lines(base->data, base_end, old0);
+  const char* t0 = skip_lines(text, text_end, new0);
+  const char* b1 = base_end;
+  const char* t1 = text_end;
+  if (j < count)
+  {
+    b1 = b0 == NULL ? NULL :
+         skip_lines(b0, base_end, S[j].old_start - old0);
+    t1 = t0 == NULL ? NULL :
+         skip_lines_back(t0, text_end, n0 - S[j].new_start);
+  }
+  if ((old0 > 0 && b0 == NULL) || (new0 > 0 && t0 == NULL) ||
+      b1 == NULL || t1 == NULL)
+    goto done;
+  if (b0 == NULL) b0 = base->data;
+  if (t0 == NULL) t0 = text;
+
+  stash_hunks_init(hunks);
+  for (int i = 0; i < k; i++)
+    put_hunk(hunks, E->data + E->hunk[2*i], E->hunk[2*i+1], &S[i], 0);
+  stash_diff_at(b0, (size_t)(b1-b0), old0,
+                t0, (size_t)(t1-t0), new0, hunks);
+  int lines = count_lines(t0, t1);
+  int delta = 0;
+  if (j < count)
+    delta = new0 + lines - S[j].new_start;
+  for (int i = j; i < count; i++)
+    put_hunk(hunks, E->data + E->hunk[2*i], E->hunk[2*i+1],
+             &S[i], delta);
+  stash_log(STASH_DEBUG, "diff cache: kept %i+%i hunks, "
+            "diffed lines %i-%i", k, count-j,
+            new0+1, new0 + lines);
+  result = true;
+
+  done:
+  free(S);
+  return result;
+}
+
+bool
+stash_diff_cache_diff(stash_diff_cache* C, const stash_base* base,
+                      const char* text, size_t text_length,
+                      stash_hunks* hunks)
+{
+  entry E;
+  bool done = false;
+  if (C->map != NULL && text_length >= STASH_DIFF_CACHE_LARGE &&
+      entry_slice(C->map, C->map_length, &E) &&
+      E.header->block == STASH_DIFF_CACHE_BLOCK &&
+      E.header->files == 0)
+    done = splice_hunks(&E, base, text, text_length, hunks);
+  if (!done &&
+      !stash_diff(base->data, base->length, text, text_length, hunks))
+    return false;
+  stash_diff_cache_store(C, hunks, text, text_length);
+  return true;
+}
+
+void
+stash_diff_cache_store(stash_diff_cache* C, const stash_hunks* hunks,
+                       const char* text, size_t text_length)
+{
+  if (!C->valid) return;
+  char dir[path_max];
+  if (!cache_dir(dir) || !mkdirp(dir)) return;
+
+  stash_diff_cache_header H;
+  memset(&H, 0, sizeof(H));
+  memcpy(H.magic, STASH_DIFF_CACHE_MAGIC, 8);
+  H.version     = STASH_DIFF_CACHE_VERSION;
+  H.ino         = C->stamp.st_ino;
+  H.dev         = C->stamp.st_dev;
+  H.size        = C->stamp.st_size;
+  H.mtime_sec   = C->stamp.st_mtim.tv_sec;
+  H.mtime_nsec  = C->stamp.st_mtim.tv_nsec;
+  H.stamped     = C->stamped;
+  strcpy(H.sha1, C->sha1);
+  H.path_length = strlen(C->path);
+  H.hunks       = hunks->count;
+  H.files       = hunks->files;
+  H.data_length = hunks->length;
+  uint64_t* head = NULL;
+  uint64_t* tail = NULL;
+  if (text != NULL && text_length >= STASH_DIFF_CACHE_LARGE &&
+      hunks->files == 0)
+  {
+    H.block  = STASH_DIFF_CACHE_BLOCK;
+    H.lines  = count_lines(text, text + text_length);
+    H.blocks = H.lines / STASH_DIFF_CACHE_BLOCK;
+    head = malloc((H.blocks * 2 + 1) * sizeof(uint64_t));
+    if (head == NULL) stash_abort("Failed to allocate memory!");
+    tail = head + H.blocks;
+    hash_blocks(text, text_length, (int) H.blocks, head, tail);
+  }
+  uint64_t* pairs = malloc((H.hunks * 2 + 1) * sizeof(uint64_t));
+  stash_diff_cache_file* files =
+    malloc((H.files + 1) * sizeof(stash_diff_cache_file));
+  if (pairs == NULL || files == NULL)
+    stash_abort("Failed to allocate memory!");
+  for (int i = 0; i < hunks->count; i++)
+  {
+    pairs[2*i]   = hunks->hunk[i].offset;
+    pairs[2*i+1] = hunks->hunk[i].length;
+  }
+  for (int i = 0; i < hunks->files; i++)
+  {
+    files[i].name        = hunks->file[i].name;
+    files[i].name_length = hunks->file[i].name_length;
+    files[i].first       = hunks->file[i].first;
+    files[i].count       = hunks->file[i].count;
+  }
+
+  stash_file tmp;
+  const char zeros[8] = { 0 };
+  const size_t pad = align8(H.path_length) - H.path_length;
+  if (!stash_file_temp(&tmp, "cache", C->name))
+    goto done;
+  bool b = stash_file_fdopen(&tmp, "w") &&
+    fwrite(&H, sizeof(H), 1, tmp.fp) == 1 &&
+    fwrite(C->path, 1, H.path_length, tmp.fp) == H.path_length &&
+    fwrite(zeros, 1, pad, tmp.fp) == pad &&
+    fwrite(head, sizeof(uint64_t), H.blocks*2, tmp.fp) == H.blocks*2 &&
+    fwrite(pairs, sizeof(uint64_t), H.hunks*2, tmp.fp) == H.hunks*2 &&
+    fwrite(files, sizeof(stash_diff_cache_file), H.files, tmp.fp) ==
+      H.files &&
+    fwrite(hunks->data, 1, H.data_length, tmp.fp) == H.data_length;
+  if (!b)
+  {
+    stash_temp_delete(&tmp);
+    goto done;
+  }
+  if (stash_file_temp_commit(&tmp, C->name))
+    stash_log(STASH_DEBUG, "diff cache: wrote: %s", C->name);
+
+  done:
+  free(head);
+  free(pairs);
+  free(files);
+}
+
+void
+stash_diff_cache_close(stash_diff_cache* C)
+{
+  if (C->map != NULL)
+    munmap(C->map, C->map_length);
+  C->map = NULL;
+}
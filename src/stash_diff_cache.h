@@ -0,0 +1,123 @@
+/*
+ * stash_diff_cache.h
+ *
+ *  On-disk cache of the hunks of working files, so a push on a
+ *  file that has not changed since the last push does not diff it
+ *  again: $XDG_CACHE_HOME/stash, else ~/.cache/stash.
+ *  An entry is used as is if the file's inode, size and mtime
+ *  and the SHA-1 of its BASE text are unchanged, and the mtime is
+ *  older than the second the file was stamped: a file written in
+ *  that second may have been written again with the same mtime.
+ *  For a large file, an entry also keeps hashes of blocks of lines
+ *  counted from each end, so if only the BASE text matches,
+ *  only the lines between the unchanged ends are diffed again.
+ *  Entries may be deleted at any time.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+#include <sys/stat.h>
+
+#include "stash_base.h"
+#include "stash_hunks.h"
+#include "util.h"
+
+#define STASH_DIFF_CACHE_MAGIC   "STASHDIF"
+#define STASH_DIFF_CACHE_VERSION 2
+
+/** Lines per block hash */
+#define STASH_DIFF_CACHE_BLOCK (1024)
+
+/** Files smaller than this are diffed again in full */
+#define STASH_DIFF_CACHE_LARGE (1024*1024)
+
+/**
+   The start of an entry.  It is followed by the path,
+   padded to 8 bytes, the block hashes from the head and
+   then from the tail of the file, the hunks as offset-length
+   pairs, the files as stash_diff_cache_file, and the hunk text.
+*/
+typedef struct
+{
+  char     magic[8];
+  uint32_t version;
+  /** Lines per block, or 0 if there are no block hashes */
+  uint32_t block;
+  /** The working file when the hunks were found */
+  uint64_t ino;
+  uint64_t dev;
+  uint64_t size;
+  int64_t  mtime_sec;
+  int64_t  mtime_nsec;
+  /** The time of the stamp, before the file was read */
+  int64_t  stamped;
+  /** The BASE text */
+  char     sha1[48];
+  uint64_t path_length;
+  /** The number of lines in the working file */
+  uint64_t lines;
+  /** Block hashes from each end */
+  uint64_t blocks;
+  uint64_t hunks;
+  uint64_t files;
+  uint64_t data_length;
+} stash_diff_cache_header;
+
+typedef struct
+{
+  uint64_t name;
+  uint64_t name_length;
+  int64_t  first;
+  int64_t  count;
+} stash_diff_cache_file;
+
+typedef struct
+{
+  /** False if the file cannot be cached */
+  bool valid;
+  /** The entry */
+  char name[path_max+32];
+  /** The real path of the working file */
+  char path[path_max];
+  struct stat stamp;
+  time_t stamped;
+  char sha1[41];
+  /** The entry mapped, if it is for this file and BASE text */
+  char* map;
+  size_t map_length;
+} stash_diff_cache;
+
+/**
+   Look up the entry for the working file.
+   Failure is not an error: C->valid is false, and
+   the other calls do nothing.
+*/
+void stash_diff_cache_open(stash_diff_cache* C, const char* text_name);
+
+/**
+   Get the hunks, if the file has not changed since they were cached
+   @return False if they were not
+*/
+bool stash_diff_cache_hunks(stash_diff_cache* C, stash_hunks* hunks);
+
+/**
+   Diff the BASE text and the working text, reusing the hunks of
+   the lines that have not changed since the entry was made,
+   and update the entry
+*/
+bool stash_diff_cache_diff(stash_diff_cache* C, const stash_base* base,
+                           const char* text, size_t text_length,
+                           stash_hunks* hunks);
+
+/**
+   Make the entry for hunks found some other way
+   text: May be NULL: no block hashes
+*/
+void stash_diff_cache_store(stash_diff_cache* C,
+                            const stash_hunks* hunks,
+                            const char* text, size_t text_length);
+
+void stash_diff_cache_close(stash_diff_cache* C);
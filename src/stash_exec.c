@@ -0,0 +1,126 @@
+/*
+ * stash_exec.c
+ *
+ *  posix_spawn() costs one exec per command where
+ *  popen() and system() cost a shell and then the command,
+ *  and argv arrays need no quoting of paths.
+ *  Pipes are close-on-exec, so children started by other threads
+ *  do not hold them open.
+ */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE // for pipe2()
+#endif
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <spawn.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#include "stash_exec.h"
+#include "stash_log.h"
+#include "util.h"
+
+extern char** environ;
+
+/** Join argv for messages, truncating if needed */
+static void
+join_argv(const char* const argv[], char* output, size_t size)
+{
+  char* p = output;
+  int n = (int) size;
+  output[0] = '\0';
+  for (int i = 0; argv[i] != NULL && n > 1; i++)
+  {
+    int c = snprintf(p, n, "%s%s", i == 0 ? "" : " ", argv[i]);
+    if (c >= n) break;
+    p += c;
+    n -= c;
+  }
+}
+
+bool
+stash_exec_spawn(stash_exec* E, const char* const argv[], int flags)
+{
+  bool result = true;
+  join_argv(argv, E->command, sizeof(E->command));
+  stash_log(STASH_DEBUG, "running: %s", E->command);
+  E->pid = -1;
+  E->fd  = -1;
+
+  int pipe_fds[2] = { -1, -1 };
+  posix_spawn_file_actions_t actions;
+  posix_spawn_file_actions_init(&actions);
+  if (flags & STASH_EXEC_PIPE)
+  {
+    int rc = pipe2(pipe_fds, O_CLOEXEC);
+    CHECK_GOTO(rc == 0, done, "could not make pipe: %s",
+               strerror(errno));
+    // dup2() clears close-on-exec on the child's stdout
+    posix_spawn_file_actions_adddup2(&actions, pipe_fds[1], 1);
+  }
+  if (flags & STASH_EXEC_QUIET)
+    posix_spawn_file_actions_addopen(&actions, 2, "/dev/null",
+                                     O_WRONLY, 0);
+
+  // The caller's thread may block signals
+  posix_spawnattr_t attr;
+  posix_spawnattr_init(&attr);
+  sigset_t none;
+  sigemptyset(&none);
+  posix_spawnattr_setsigmask(&attr, &none);
+  posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGMASK);
+
+  int rc = posix_spawnp(&E->pid, argv[0], &actions, &attr,
+                        (char* const*) argv, environ);
+  posix_spawnattr_destroy(&attr);
+  CHECK_GOTO(rc == 0, done, "could not run: %s: %s",
+             E->command, strerror(rc));
+  if (flags & STASH_EXEC_PIPE)
+  {
+    E->fd = pipe_fds[0];
+    pipe_fds[0] = -1;
+  }
+
+  done:
+  if (pipe_fds[0] != -1) close(pipe_fds[0]);
+  if (pipe_fds[1] != -1) close(pipe_fds[1]);
+  posix_spawn_file_actions_destroy(&actions);
+  return result;
+}
+
+bool
+stash_exec_wait(stash_exec* E, int* status)
+{
+  if (E->fd != -1)
+  {
+    close(E->fd);
+    E->fd = -1;
+  }
+  int s;
+  pid_t rc;
+  do
+    rc = waitpid(E->pid, &s, 0);
+  while (rc == -1 && errno == EINTR);
+  CHECK(rc == E->pid, "could not wait for: %s: %s",
+        E->command, strerror(errno));
+  E->pid = -1;
+  if (status != NULL) *status = s;
+  return WIFEXITED(s) && WEXITSTATUS(s) == 0;
+}
+
+void
+stash_exec_describe(int status, char* output, size_t size)
+{
+  if (WIFEXITED(status))
+    snprintf(output, size, "exit code %i", WEXITSTATUS(status));
+  else if (WIFSIGNALED(status))
+    snprintf(output, size, "signal %i (%s)", WTERMSIG(status),
+             strsignal(WTERMSIG(status)));
+  else
+    snprintf(output, size, "wait status %i", status);
+}
@@ -0,0 +1,46 @@
+/*
+ * stash_exec.h
+ *
+ *  Run helper programs with posix_spawn(): argv arrays, no shell
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+/** Redirections for the child */
+enum
+{
+  /** Read the child's stdout from stash_exec.fd */
+  STASH_EXEC_PIPE  = 1 << 0,
+  /** Send the child's stderr to /dev/null */
+  STASH_EXEC_QUIET = 1 << 1
+};
+
+typedef struct
+{
+  pid_t pid;
+  /** The read end of the child's stdout, or -1 */
+  int fd;
+  /** The command line, for messages */
+  char command[256];
+} stash_exec;
+
+/**
+   Start argv[0], found in PATH, with the given arguments
+   argv: NULL-terminated
+   flags: STASH_EXEC_*
+*/
+bool stash_exec_spawn(stash_exec* E, const char* const argv[], int flags);
+
+/**
+   Close the pipe, if any, and wait for the child
+   status: OUT: The wait status: may be NULL
+   @return True if the child exited with code 0
+*/
+bool stash_exec_wait(stash_exec* E, int* status);
+
+/** Describe a wait status: "exit code 1", "signal 9 (Killed)" */
+void stash_exec_describe(int status, char* output, size_t size);
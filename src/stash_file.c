@@ -6,16 +6,27 @@
  *      Author: wozniak
  */
 
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE // for copy_file_range()
+#endif
+
+#include "config.h"
+
 #include <errno.h>
 #include <fcntl.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <linux/fs.h>
 
 #include "stash_file.h"
 #include "stash_log.h"
 
+__thread bool stash_file_fsync = false;
+
 static inline void
 stash_file_reset(stash_file* file)
 {
@@ -27,6 +38,7 @@ void
 stash_file_init(stash_file* file, const char* label)
 {
   strcpy(file->label, label);
+  file->anonymous = false;
   stash_file_reset(file);
 }
 
@@ -50,50 +62,135 @@ stash_make_temp(stash_file* file, const char* label,
   return true;
 }
 
-bool
-stash_file_fopen_r(stash_file* file)
+/** @return True if O_TMPFILEs can be linked by their /proc path */
+static bool
+proc_fd_available(void)
 {
-  file->fp = fopen(file->name, "r");
-  CHECK(file->fp != NULL, "could not fopen (r/o): %s", file->name);
-  return true;
+  static int available = -1;
+  if (available == -1)
+    available = (access("/proc/self/fd", X_OK) == 0);
+  return available;
+}
+
+/** The directory that holds name */
+static void
+parent_dir(const char* name, char* dir)
+{
+  strcpy(dir, name);
+  char* slash = strrchr(dir, '/');
+  if (slash == NULL)
+    strcpy(dir, ".");
+  else if (slash == dir)
+    dir[1] = '\0';
+  else
+    *slash = '\0';
 }
 
 bool
-stash_file_fopen_w(stash_file* file)
+stash_file_temp(stash_file* file, const char* label, const char* target)
 {
-  file->fp = fopen(file->name, "w");
-  CHECK(file->fp != NULL, "could not fopen (w/o): %s", file->name);
-  return true;
+  stash_file_init(file, label);
+#ifdef O_TMPFILE
+  if (proc_fd_available())
+  {
+    char dir[path_max];
+    parent_dir(target, dir);
+    int fd = open(dir, O_TMPFILE|O_RDWR, 0600);
+    if (fd != -1)
+    {
+      file->fd = fd;
+      file->anonymous = true;
+      sprintf(file->name, "/proc/self/fd/%i", fd);
+      stash_log(STASH_TRACE, "anonymous temp file in: %s", dir);
+      return true;
+    }
+    // Not supported by this file system: use a name
+    stash_log(STASH_DEBUG, "no O_TMPFILE in %s: %s",
+              dir, strerror(errno));
+  }
+#endif
+  char template[path_max+16];
+  sprintf(template, "%s.XXXXXX", target);
+  return stash_make_temp(file, label, template, 0);
 }
 
 bool
-stash_file_fopen_rw(stash_file* file)
+stash_file_temp_replace(stash_file* file, const char* label,
+                        const char* name, char* target)
 {
-  stash_log(STASH_DEBUG, "file open r/w: [%s] %s",
-            file->label, file->name);
-  mode_t mode = S_IRUSR | S_IWUSR;
-  file->fd = open(file->name, O_RDWR|O_CREAT, mode);
-  CHECK(file->fd > 0, "could not open (r/w): '%s': %s",
-        file->name, strerror(errno));
-  file->fp = fdopen(file->fd, "r+");
-  CHECK(file->fp != NULL, "could not fdopen (r/w): %s", file->name);
+  // Replace the file a symbolic link points to, not the link
+  if (realpath(name, target) == NULL)
+    strcpy(target, name);
+  struct stat s;
+  int rc = stat(target, &s);
+  CHECK(rc == 0, "could not stat: %s", name);
+  bool b = stash_file_temp(file, label, target);
+  CHECK(b, "could not write: %s", name);
+  fchmod(file->fd, s.st_mode & 07777);
   return true;
 }
 
 bool
-stash_file_fopen_rw_exists(stash_file* file, bool* existed)
+stash_file_temp_commit(stash_file* file, const char* target)
 {
-  file->fp = fopen(file->name, "r+");
-  if (file->fp == NULL)
+  bool result = true;
+  char link[path_max+32] = "";
+  CHECK_GOTO(stash_file_sync(file), done, "could not write: %s", target);
+  if (file->anonymous)
   {
-    *existed = false;
-    stash_log(STASH_DEBUG,
-              "there is no existing file at %s", file->name);
-    file->fp = fopen(file->name, "w");
-    CHECK(file->fp != NULL, "could not create: %s", file->name);
+    // linkat() cannot replace target: link beside it, then rename
+    int rc = -1;
+    for (int i = 0; rc == -1 && i < 100; i++)
+    {
+      sprintf(link, "%s.%i.%i", target, (int) getpid(), i);
+      rc = linkat(AT_FDCWD, file->name, AT_FDCWD, link,
+                  AT_SYMLINK_FOLLOW);
+      if (rc == -1 && errno != EEXIST) break;
+    }
+    if (rc == -1)
+    {
+      // Do not remove a file of the same name
+      link[0] = '\0';
+      FAIL_GOTO(done, "could not link temp file to: %s: %s",
+                target, strerror(errno));
+    }
   }
   else
-    *existed = true;
+    strcpy(link, file->name);
+  int rc = rename(link, target);
+  CHECK_GOTO(rc == 0, done, "could not rename %s to %s: %s",
+             link, target, strerror(errno));
+  link[0] = '\0';
+  CHECK_GOTO(stash_file_sync_dir(target), done,
+             "could not write: %s", target);
+
+  done:
+  if (!result && link[0] != '\0')
+    unlink(link);
+  stash_file_close(file);
+  file->anonymous = false;
+  return result;
+}
+
+bool
+stash_file_fopen_r(stash_file* file)
+{
+  file->fp = fopen(file->name, "r");
+  CHECK(file->fp != NULL, "could not fopen (r/o): %s", file->name);
+  return true;
+}
+
+bool
+stash_file_fopen_a(stash_file* file)
+{
+  stash_log(STASH_DEBUG, "file open append: [%s] %s",
+            file->label, file->name);
+  mode_t mode = S_IRUSR | S_IWUSR;
+  file->fd = open(file->name, O_WRONLY|O_APPEND|O_CREAT, mode);
+  CHECK(file->fd > 0, "could not open (append): '%s': %s",
+        file->name, strerror(errno));
+  file->fp = fdopen(file->fd, "a");
+  CHECK(file->fp != NULL, "could not fdopen (append): %s", file->name);
   return true;
 }
 
@@ -105,6 +202,37 @@ stash_file_fdopen(stash_file* file, const char* mode)
   return true;
 }
 
+bool
+stash_file_spawn(stash_file* file, const char* const argv[])
+{
+  bool b = stash_exec_spawn(&file->exec, argv, STASH_EXEC_PIPE);
+  if (!b) return false;
+  strcpy(file->name, file->exec.command);
+  file->fd = file->exec.fd;
+  file->fp = fdopen(file->fd, "r");
+  CHECK(file->fp != NULL, "could not fdopen: %s", file->name);
+  return true;
+}
+
+bool
+stash_file_wait(stash_file* file)
+{
+  // fclose() closes the pipe
+  fclose(file->fp);
+  file->exec.fd = -1;
+  stash_file_reset(file);
+  int status;
+  bool b = stash_exec_wait(&file->exec, &status);
+  if (file->exec.pid != -1) return false; // Could not wait
+  if (!b)
+  {
+    char reason[64];
+    stash_exec_describe(status, reason, sizeof(reason));
+    FAIL("command failed: %s: %s", file->name, reason);
+  }
+  return true;
+}
+
 bool
 stash_file_append(stash_file* file, const char* hunk)
 {
@@ -115,6 +243,59 @@ stash_file_append(stash_file* file, const char* hunk)
   return true;
 }
 
+bool
+stash_file_write(stash_file* file, const char* data, size_t length)
+{
+  stash_log(STASH_TRACE, "stash_file_write: [%s]", file->label);
+  size_t count = fwrite(data, 1, length, file->fp);
+  CHECK(count == length, "could not write to: %s", file->name);
+  fflush(file->fp);
+  return true;
+}
+
+bool
+stash_file_clone(stash_file* file, int fd, size_t length)
+{
+#ifdef FICLONE
+  if (ioctl(file->fd, FICLONE, fd) == 0)
+  {
+    stash_log(STASH_TRACE, "reflinked: %s", file->name);
+    return true;
+  }
+#endif
+  return stash_file_copy_range(file, fd, 0, length);
+}
+
+bool
+stash_file_copy_range(stash_file* file, int fd, off_t offset,
+                      size_t length)
+{
+  stash_log(STASH_TRACE, "stash_file_copy_range: [%s] %zi@%zi",
+            file->label, length, (size_t) offset);
+#if HAVE_COPY_FILE_RANGE
+  // In-kernel copy: the data need not pass through user space
+  while (length > 0)
+  {
+    ssize_t n = copy_file_range(fd, &offset, file->fd, NULL, length, 0);
+    if (n <= 0) break;
+    length -= n;
+  }
+  if (length == 0) return true;
+#endif
+  char chunk[64*1024];
+  while (length > 0)
+  {
+    size_t c = length < sizeof(chunk) ? length : sizeof(chunk);
+    ssize_t n = pread(fd, chunk, c, offset);
+    CHECK(n > 0, "could not read for: %s", file->name);
+    ssize_t w = write(file->fd, chunk, n);
+    CHECK(w == n, "could not write to: %s", file->name);
+    offset += n;
+    length -= n;
+  }
+  return true;
+}
+
 bool
 stash_file_slurp(stash_file* file, char** result)
 {
@@ -127,15 +308,28 @@ stash_file_slurp(stash_file* file, char** result)
 }
 
 bool
-stash_file_clobber(stash_file* file)
+stash_file_sync(stash_file* file)
+{
+  if (file->fp != NULL && fflush(file->fp) != 0)
+    FAIL("could not write: %s: %s", file->name, strerror(errno));
+  if (!stash_file_fsync) return true;
+  int fd = file->fp != NULL ? fileno(file->fp) : file->fd;
+  CHECK(fdatasync(fd) == 0, "could not sync: %s: %s",
+        file->name, strerror(errno));
+  return true;
+}
+
+bool
+stash_file_sync_dir(const char* name)
 {
-  assert(file->fp != NULL);
-  clearerr(file->fp);
-  int rc;
-  rc = fseek(file->fp, 0, SEEK_SET);
-  assert(rc == 0);
-  rc = ftruncate(fileno(file->fp), 0);
-  assert(rc == 0);
+  if (!stash_file_fsync) return true;
+  char dir[path_max];
+  parent_dir(name, dir);
+  int fd = open(dir, O_RDONLY|O_DIRECTORY);
+  CHECK(fd != -1, "could not open: %s: %s", dir, strerror(errno));
+  int rc = fsync(fd);
+  close(fd);
+  CHECK(rc == 0, "could not sync: %s: %s", dir, strerror(errno));
   return true;
 }
 
@@ -159,6 +353,9 @@ stash_temp_delete(stash_file* file)
 {
   bool b = stash_file_close(file);
   CHECK(b, "stash_temp_delete(): could not close: %s", file->name);
-  unlink(file->name);
+  // An anonymous file is gone once closed
+  if (!file->anonymous)
+    unlink(file->name);
+  file->anonymous = false;
   return true;
 }
@@ -8,15 +8,27 @@
 #pragma once
 
 #include <stdbool.h>
+#include <sys/types.h>
 
+#include "stash_exec.h"
 #include "util.h"
 
+/**
+   If true (--fsync), file data is flushed to disk before each
+   rename into place, and the directory after it
+*/
+extern __thread bool stash_file_fsync;
+
 typedef struct
 {
   int fd;
   FILE* fp;
   char label[64];
   char name[path_max];
+  /** True if this is an O_TMPFILE: name is its /proc/self/fd path */
+  bool anonymous;
+  /** The child, if this is the output of a command */
+  stash_exec exec;
 } stash_file;
 
 void stash_file_init(stash_file* file, const char* label);
@@ -27,20 +39,68 @@ void stash_file_init_name(stash_file* file, const char* label,
 bool stash_make_temp(stash_file* file, const char* label,
                      const char* template, int suffix_length);
 
+/**
+   Make an unbuffered temp file that will replace target.
+   It is anonymous (O_TMPFILE) in the directory of target if possible,
+   so nothing is left behind if stash fails before the commit,
+   else it is named target.XXXXXX
+*/
+bool stash_file_temp(stash_file* file, const char* label,
+                     const char* target);
+
+/**
+   Make a temp file to replace name, with the mode of name
+   target: OUT: The file to commit to:
+           name, or the file name links to
+*/
+bool stash_file_temp_replace(stash_file* file, const char* label,
+                             const char* name, char* target);
+
+/**
+   Close the temp file and rename it to target, replacing target:
+   readers see the old file or the new one, never a mix
+*/
+bool stash_file_temp_commit(stash_file* file, const char* target);
+
 bool stash_file_fopen_r(stash_file* file);
 
-bool stash_file_fopen_w(stash_file* file);
+/** Open for appending, creating the file if needed */
+bool stash_file_fopen_a(stash_file* file);
 
-bool stash_file_fopen_rw(stash_file* file);
+bool stash_file_fdopen(stash_file* file, const char* mode);
 
-bool stash_file_fopen_rw_exists(stash_file* file, bool* existed);
+/**
+   Read the output of a command as it is produced
+   argv: NULL-terminated: see stash_exec_spawn()
+*/
+bool stash_file_spawn(stash_file* file, const char* const argv[]);
 
-bool stash_file_fdopen(stash_file* file, const char* mode);
+/** @return False if the command failed */
+bool stash_file_wait(stash_file* file);
 
-bool stash_file_clobber(stash_file* file);
+/** Flush the file, and with stash_file_fsync, sync its data */
+bool stash_file_sync(stash_file* file);
+
+/** With stash_file_fsync, sync the directory entry of name */
+bool stash_file_sync_dir(const char* name);
 
 bool stash_file_append(stash_file* file, const char* hunk);
 
+bool stash_file_write(stash_file* file, const char* data, size_t length);
+
+/**
+   Append length bytes of fd at offset to the unbuffered file
+   Uses copy_file_range() if possible
+*/
+bool stash_file_copy_range(stash_file* file, int fd, off_t offset,
+                           size_t length);
+
+/**
+   Fill the empty unbuffered file with length bytes of fd:
+   a reflink if the file system can, else a copy
+*/
+bool stash_file_clone(stash_file* file, int fd, size_t length);
+
 bool stash_file_slurp(stash_file* file, char** result);
 
 bool stash_file_close(stash_file* file);
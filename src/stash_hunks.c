@@ -0,0 +1,266 @@
+/*
+ * stash_hunks.c
+ *
+ *  Hunks as slices of one text.
+ *  Hunks are not copied: each is an (offset, length) pair,
+ *  found with memchr() and with no limit on line length.
+ */
+
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "stash.h"
+#include "stash_hunks.h"
+#include "stash_index.h"
+#include "stash_log.h"
+#include "util.h"
+
+void
+stash_hunks_init(stash_hunks* H)
+{
+  memset(H, 0, sizeof(*H));
+}
+
+stash_hunk*
+stash_hunks_add(stash_hunks* H, size_t offset, size_t length)
+{
+  if (H->count == H->hunk_capacity)
+  {
+    int c = H->hunk_capacity == 0 ? 64 : H->hunk_capacity * 2;
+    H->hunk = stash_grow(H->hunk,
+                         H->hunk_capacity * sizeof(stash_hunk),
+                         c * sizeof(stash_hunk));
+    H->hunk_capacity = c;
+  }
+  stash_hunk* hunk = &H->hunk[H->count++];
+  hunk->offset   = offset;
+  hunk->length   = length;
+  hunk->section  = H->section;
+  hunk->indexed  = false;
+  hunk->checksum = 0;
+  hunk->removed  = false;
+  H->live++;
+  if (H->files > 0)
+    H->file[H->files-1].count++;
+  return hunk;
+}
+
+/** Start a new file at its "Index: " line */
+static void
+add_file(stash_hunks* H, size_t line, size_t length)
+{
+  if (H->files == H->file_capacity)
+  {
+    int c = H->file_capacity == 0 ? 16 : H->file_capacity * 2;
+    H->file = stash_grow(H->file,
+                         H->file_capacity * sizeof(stash_hunks_file),
+                         c * sizeof(stash_hunks_file));
+    H->file_capacity = c;
+  }
+  stash_hunks_file* file = &H->file[H->files++];
+  file->name = line + 7;
+  file->name_length = length - 7;
+  // Strip the line end
+  while (file->name_length > 0 &&
+         (H->data[file->name+file->name_length-1] == '\n' ||
+          H->data[file->name+file->name_length-1] == '\r'))
+    file->name_length--;
+  file->first = H->count;
+  file->count = 0;
+}
+
+void
+stash_hunks_file_name(const stash_hunks* H, int f, char* output)
+{
+  const stash_hunks_file* file = &H->file[f];
+  size_t n = file->name_length < path_max-1 ?
+             file->name_length : path_max-1;
+  memcpy(output, H->data + file->name, n);
+  output[n] = '\0';
+}
+
+void
+stash_hunks_compact(stash_hunks* H)
+{
+  int j = 0;
+  for (int i = 0; i < H->count; i++)
+    if (!H->hunk[i].removed)
+      H->hunk[j++] = H->hunk[i];
+  H->count = j;
+}
+
+static inline void
+close_hunk(stash_hunks* H, size_t end)
+{
+  if (!H->open) return;
+  stash_hunks_add(H, H->start, end - H->start);
+  H->open = false;
+}
+
+/**
+   Scan the complete lines not yet scanned.
+   A hunk runs from its "@@" line to the next "@@" line,
+   or to the next file in a multi-file diff or its properties,
+   or to the next stash section, or to the end.
+   Anything before the first hunk is headers.
+   eof: If true, the last line may lack a newline
+ */
+static void
+scan(stash_hunks* H, bool eof)
+{
+  const char* data = H->data;
+  const size_t marker_length = strlen(STASH_SECTION_MARKER);
+  while (H->scan < H->length)
+  {
+    size_t p = H->scan;
+    const char* q = memchr(data+p, '\n', H->length-p);
+    size_t next;
+    if (q != NULL)
+      next = (size_t)(q-data) + 1;
+    else if (eof)
+      next = H->length;
+    else
+      break;
+    size_t n = next - p;
+    if (n >= 2 && data[p] == '@' && data[p+1] == '@')
+    {
+      close_hunk(H, p);
+      H->open  = true;
+      H->start = p;
+    }
+    else if (n >= 7 && memcmp(data+p, "Index: ", 7) == 0)
+    {
+      close_hunk(H, p);
+      add_file(H, p, n);
+    }
+    else if (n >= 20 && memcmp(data+p, "Property changes on:", 20) == 0)
+      close_hunk(H, p);
+    else if (n >= marker_length &&
+             memcmp(data+p, STASH_SECTION_MARKER, marker_length) == 0)
+    {
+      close_hunk(H, p);
+      H->section++;
+    }
+    H->scan = next;
+  }
+  if (eof)
+    close_hunk(H, H->length);
+}
+
+static int
+newest_first(const void* p1, const void* p2)
+{
+  const stash_hunk* h1 = p1;
+  const stash_hunk* h2 = p2;
+  if (h1->section != h2->section)
+    return h2->section - h1->section;
+  return h1->offset < h2->offset ? -1 : 1;
+}
+
+/** Put the hunks of later pushes first, as users number them */
+static void
+sort_sections(stash_hunks* H)
+{
+  qsort(H->hunk, H->count, sizeof(stash_hunk), newest_first);
+}
+
+bool
+stash_hunks_map(stash_hunks* H, const char* filename)
+{
+  bool result = true;
+  stash_log(STASH_DEBUG, "parsing: %s", filename);
+  int fd = open(filename, O_RDONLY);
+  CHECK(fd != -1, "could not open: %s", filename);
+  struct stat s;
+  int rc = fstat(fd, &s);
+  CHECK_GOTO(rc == 0, done, "could not stat: %s", filename);
+  if (s.st_size > 0)
+  {
+    void* p = mmap(NULL, s.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    CHECK_GOTO(p != MAP_FAILED, done, "could not mmap: %s", filename);
+    H->data = p;
+  }
+  H->length = s.st_size;
+  H->mapped = true;
+  if (!stash_index_read(filename, &s, H))
+  {
+    scan(H, true);
+    if (H->section > 0)
+      sort_sections(H);
+    stash_index_write_hunks(filename, H);
+  }
+
+  done:
+  close(fd);
+  return result;
+}
+
+void
+stash_hunks_put(stash_hunks* H, const char* data, size_t length)
+{
+  assert(!H->mapped);
+  if (H->length + length > H->capacity)
+  {
+    size_t c = H->capacity == 0 ? 64*1024 : H->capacity;
+    while (H->length + length > c)
+      c *= 2;
+    char* t = realloc(H->data, c);
+    if (t == NULL)
+      stash_abort("Failed to allocate memory!");
+    H->data = t;
+    H->capacity = c;
+  }
+  memcpy(H->data+H->length, data, length);
+  H->length += length;
+}
+
+bool
+stash_hunks_read(stash_hunks* H, FILE* fp, const char* name)
+{
+  stash_log(STASH_DEBUG, "parsing: %s", name);
+  char chunk[64*1024];
+  size_t actual;
+  while ((actual = fread(chunk, 1, sizeof(chunk), fp)) > 0)
+    stash_hunks_feed(H, chunk, actual);
+  CHECK(!ferror(fp), "read error in %s", name);
+  stash_hunks_end(H);
+  return true;
+}
+
+void
+stash_hunks_feed(stash_hunks* H, const char* data, size_t length)
+{
+  stash_hunks_put(H, data, length);
+  scan(H, false);
+}
+
+void
+stash_hunks_end(stash_hunks* H)
+{
+  scan(H, true);
+}
+
+bool
+stash_hunk_write(const stash_hunks* H, const stash_hunk* hunk, FILE* fp)
+{
+  size_t n = fwrite(stash_hunk_text(H, hunk), 1, hunk->length, fp);
+  return n == hunk->length;
+}
+
+void
+stash_hunks_finalize(stash_hunks* H)
+{
+  if (H->mapped)
+  {
+    if (H->data != NULL)
+      munmap(H->data, H->length);
+  }
+  else
+    free(H->data);
+  // The hunk array is in stash_arena
+  stash_hunks_init(H);
+}
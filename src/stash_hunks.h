@@ -0,0 +1,143 @@
+/*
+ * stash_hunks.h
+ *
+ *  Hunks as slices of one text: a mapped stash file,
+ *  the output of svn diff, or the output of stash_diff()
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+
+/** One hunk: a slice of stash_hunks.data */
+typedef struct
+{
+  size_t offset;
+  size_t length;
+  /** The push that added this hunk: see stash_hunks_map() */
+  int section;
+  /** If indexed, the checksum recorded in the stash index */
+  bool indexed;
+  uint32_t checksum;
+  /** Tombstone: see stash_hunks_remove() */
+  bool removed;
+} stash_hunk;
+
+/** A file in a multi-file diff, from its "Index: " line */
+typedef struct
+{
+  /** The name: a slice of stash_hunks.data */
+  size_t name;
+  size_t name_length;
+  /** The hunks of this file: they are contiguous */
+  int first;
+  int count;
+} stash_hunks_file;
+
+typedef struct
+{
+  /** All hunk text */
+  char* data;
+  size_t length;
+  size_t capacity;
+  /** True if data is mapped from a file */
+  bool mapped;
+  /** Parser state: next line to scan, start of the open hunk */
+  size_t scan;
+  size_t start;
+  bool open;
+  int section;
+  /** The hunks in order, including removed hunks until compacted */
+  stash_hunk* hunk;
+  int count;
+  int hunk_capacity;
+  /** The number of hunks not removed */
+  int live;
+  /** The files, if this is a multi-file diff */
+  stash_hunks_file* file;
+  int files;
+  int file_capacity;
+} stash_hunks;
+
+void stash_hunks_init(stash_hunks* H);
+
+/**
+   A stash file is appended to by each push:
+   each push starts a section with a marker line.
+   Text before the first marker is the oldest section.
+*/
+#define STASH_SECTION_MARKER "## stash push"
+
+/**
+   Map a stash file and slice it into hunks, newest section first.
+   The hunks come from the stash index if it is current,
+   else the stash is scanned and the index is rebuilt.
+*/
+bool stash_hunks_map(stash_hunks* H, const char* filename);
+
+/** Read a stream, slicing hunks as the text arrives */
+bool stash_hunks_read(stash_hunks* H, FILE* fp, const char* name);
+
+/** Append text that arrives in pieces, slicing the complete lines */
+void stash_hunks_feed(stash_hunks* H, const char* data, size_t length);
+
+/** The fed text is complete: slice the rest */
+void stash_hunks_end(stash_hunks* H);
+
+/** Append text to an unmapped stash_hunks */
+void stash_hunks_put(stash_hunks* H, const char* data, size_t length);
+
+/**
+   Add a hunk for text already in H
+   @return The new hunk, valid until the next add
+*/
+stash_hunk* stash_hunks_add(stash_hunks* H,
+                            size_t offset, size_t length);
+
+/** Remove a hunk in O(1): indices are unchanged until compacted */
+static inline void
+stash_hunks_remove(stash_hunks* H, int i)
+{
+  if (H->hunk[i].removed) return;
+  H->hunk[i].removed = true;
+  H->live--;
+}
+
+/** @return The first hunk index >= i not removed, or H->count */
+static inline int
+stash_hunks_next(const stash_hunks* H, int i)
+{
+  while (i < H->count && H->hunk[i].removed)
+    i++;
+  return i;
+}
+
+/** @return The last hunk index <= i not removed, or -1 */
+static inline int
+stash_hunks_prev(const stash_hunks* H, int i)
+{
+  while (i >= 0 && H->hunk[i].removed)
+    i--;
+  return i;
+}
+
+/** Copy the name of file f, NUL-terminated, into output */
+void stash_hunks_file_name(const stash_hunks* H, int f, char* output);
+
+/** Drop removed hunks, renumbering the rest */
+void stash_hunks_compact(stash_hunks* H);
+
+static inline const char*
+stash_hunk_text(const stash_hunks* H, const stash_hunk* hunk)
+{
+  return H->data + hunk->offset;
+}
+
+bool stash_hunk_write(const stash_hunks* H, const stash_hunk* hunk,
+                      FILE* fp);
+
+void stash_hunks_finalize(stash_hunks* H);
@@ -0,0 +1,191 @@
+/*
+ * stash_image.c
+ *
+ *  Sidecar copy of a file as it was before a push.
+ *  The copy is cloned from the file, and cloned back on pop,
+ *  so on a file system with reflinks neither copy moves the data.
+ */
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "stash_image.h"
+#include "stash_log.h"
+#include "util.h"
+
+void
+stash_image_filename(const char* stash_name, char* output)
+{
+  sprintf(output, "%s.img", stash_name);
+}
+
+/** Hash the file as it is now */
+static bool
+text_hash(const char* text_name, uint64_t* size, uint64_t* hash)
+{
+  int fd = open(text_name, O_RDONLY);
+  if (fd == -1) return false;
+  bool result = false;
+  struct stat s;
+  if (fstat(fd, &s) != 0) goto done;
+  *size = s.st_size;
+  if (s.st_size == 0)
+  {
+    *hash = hash_data(NULL, 0);
+    result = true;
+    goto done;
+  }
+  void* p = mmap(NULL, s.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  if (p == MAP_FAILED) goto done;
+  *hash = hash_data(p, s.st_size);
+  munmap(p, s.st_size);
+  result = true;
+
+  done:
+  close(fd);
+  return result;
+}
+
+static bool
+stash_matches(const stash_image_trailer* T, const struct stat* s)
+{
+  return T->stash_ino        == (uint64_t) s->st_ino          &&
+         T->stash_size       == (uint64_t) s->st_size         &&
+         T->stash_mtime_sec  == (int64_t)  s->st_mtim.tv_sec  &&
+         T->stash_mtime_nsec == (int64_t)  s->st_mtim.tv_nsec;
+}
+
+void
+stash_image_begin(stash_image* I, const char* text_name,
+                  const char* stash_name)
+{
+  I->active = false;
+  stash_image_filename(stash_name, I->name);
+  struct stat s;
+  if (stat(stash_name, &s) == 0 && s.st_size > 0)
+  {
+    // Popping all would pop the older hunks too
+    stash_image_remove(stash_name);
+    return;
+  }
+  int fd = open(text_name, O_RDONLY);
+  if (fd == -1) return;
+  if (fstat(fd, &s) != 0 ||
+      !stash_file_temp(&I->file, "image", I->name))
+  {
+    close(fd);
+    return;
+  }
+  I->length = s.st_size;
+  I->active = stash_file_clone(&I->file, fd, I->length);
+  close(fd);
+  if (!I->active)
+    stash_temp_delete(&I->file);
+}
+
+void
+stash_image_commit(stash_image* I, const char* text_name,
+                   const char* stash_name)
+{
+  if (!I->active) return;
+  stash_image_trailer T;
+  memset(&T, 0, sizeof(T));
+  memcpy(T.magic, STASH_IMAGE_MAGIC, 8);
+  T.version = STASH_IMAGE_VERSION;
+  T.length  = I->length;
+  struct stat s;
+  if (stat(stash_name, &s) != 0 ||
+      !text_hash(text_name, &T.text_size, &T.text_hash))
+    goto failed;
+  T.stash_ino        = s.st_ino;
+  T.stash_size       = s.st_size;
+  T.stash_mtime_sec  = s.st_mtim.tv_sec;
+  T.stash_mtime_nsec = s.st_mtim.tv_nsec;
+  if (pwrite(I->file.fd, &T, sizeof(T), I->length) != sizeof(T))
+    goto failed;
+  if (!stash_file_temp_commit(&I->file, I->name))
+  {
+    I->active = false;
+    return;
+  }
+  stash_log(STASH_DEBUG, "wrote image: %s", I->name);
+  I->active = false;
+  return;
+
+  failed:
+  stash_log(STASH_DEBUG, "could not write image: %s", I->name);
+  stash_image_abort(I);
+}
+
+void
+stash_image_abort(stash_image* I)
+{
+  if (!I->active) return;
+  stash_temp_delete(&I->file);
+  I->active = false;
+}
+
+bool
+stash_image_restore(const char* text_name, const char* stash_name)
+{
+  char image_name[path_max+8];
+  stash_image_filename(stash_name, image_name);
+  int fd = open(image_name, O_RDONLY);
+  if (fd == -1) return false;
+
+  bool result = false;
+  stash_image_trailer T;
+  struct stat s;
+  if (fstat(fd, &s) != 0 || s.st_size < (off_t) sizeof(T) ||
+      pread(fd, &T, sizeof(T), s.st_size - sizeof(T)) != sizeof(T) ||
+      memcmp(T.magic, STASH_IMAGE_MAGIC, 8) != 0 ||
+      T.version != STASH_IMAGE_VERSION ||
+      T.length + sizeof(T) != (uint64_t) s.st_size)
+  {
+    stash_log(STASH_DEBUG, "bad image: %s", image_name);
+    goto done;
+  }
+  if (stat(stash_name, &s) != 0 || !stash_matches(&T, &s))
+  {
+    stash_log(STASH_DEBUG, "stale image: %s", image_name);
+    goto done;
+  }
+  uint64_t size, hash;
+  if (!text_hash(text_name, &size, &hash) ||
+      size != T.text_size || hash != T.text_hash)
+  {
+    stash_log(STASH_DEBUG, "modified since push: %s", text_name);
+    goto done;
+  }
+
+  char target[path_max];
+  stash_file tmp;
+  if (!stash_file_temp_replace(&tmp, "text", text_name, target))
+    goto done;
+  // A reflink takes the whole image: drop the trailer
+  if (!stash_file_clone(&tmp, fd, T.length) ||
+      ftruncate(tmp.fd, T.length) != 0)
+  {
+    stash_temp_delete(&tmp);
+    goto done;
+  }
+  result = stash_file_temp_commit(&tmp, target);
+  if (result)
+    stash_log(STASH_DEBUG, "restored image: %s", image_name);
+
+  done:
+  close(fd);
+  return result;
+}
+
+void
+stash_image_remove(const char* stash_name)
+{
+  char image_name[path_max+8];
+  stash_image_filename(stash_name, image_name);
+  unlink(image_name);
+}
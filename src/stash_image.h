@@ -0,0 +1,75 @@
+/*
+ * stash_image.h
+ *
+ *  Sidecar copy of a file as it was before a push: <file>.stash.img
+ *  If neither the file nor the stash has changed since the push,
+ *  popping every hunk just restores this copy.
+ *  The image is only trusted if it matches the stash file's
+ *  inode, size and mtime, and the hash of the pushed file.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "stash_file.h"
+#include "util.h"
+
+#define STASH_IMAGE_MAGIC   "STASHIMG"
+#define STASH_IMAGE_VERSION 1
+
+/** Follows the saved text, so the text can be cloned as is */
+typedef struct
+{
+  char     magic[8];
+  uint32_t version;
+  uint32_t reserved;
+  /** The saved text, before this trailer */
+  uint64_t length;
+  /** The stash file after the push */
+  uint64_t stash_ino;
+  uint64_t stash_size;
+  int64_t  stash_mtime_sec;
+  int64_t  stash_mtime_nsec;
+  /** The file after the push */
+  uint64_t text_size;
+  uint64_t text_hash;
+} stash_image_trailer;
+
+/** A push in progress */
+typedef struct
+{
+  /** False if no image is being made */
+  bool active;
+  char name[path_max+8];
+  stash_file file;
+  uint64_t length;
+} stash_image;
+
+void stash_image_filename(const char* stash_name, char* output);
+
+/**
+   Before a push: if the stash is empty, save the file as it is now.
+   Else any image is stale, and is removed.
+   Failure is not an error: there will be no image.
+*/
+void stash_image_begin(stash_image* I, const char* text_name,
+                       const char* stash_name);
+
+/** After a successful push: record the file and the stash, and
+    rename the image into place */
+void stash_image_commit(stash_image* I, const char* text_name,
+                        const char* stash_name);
+
+/** After a failed push */
+void stash_image_abort(stash_image* I);
+
+/**
+   Pop all hunks by restoring the saved file,
+   if the file and the stash are as the push left them
+   @return False if there is no such image, quietly
+*/
+bool stash_image_restore(const char* text_name, const char* stash_name);
+
+void stash_image_remove(const char* stash_name);
@@ -0,0 +1,299 @@
+/*
+ * stash_index.c
+ *
+ *  Sidecar index of the hunks in a stash file
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "stash.h"
+#include "stash_index.h"
+#include "stash_log.h"
+#include "stash_patch.h"
+
+void
+stash_index_filename(const char* stash_name, char* output)
+{
+  sprintf(output, "%s.idx", stash_name);
+}
+
+/** FNV-1a */
+uint32_t
+stash_index_checksum(const char* data, size_t length)
+{
+  uint32_t h = 2166136261u;
+  for (size_t i = 0; i < length; i++)
+  {
+    h ^= (unsigned char) data[i];
+    h *= 16777619u;
+  }
+  return h;
+}
+
+/** Count the '+' and '-' lines after the "@@" line */
+static void
+count_lines(const char* text, size_t length, int* added, int* removed)
+{
+  *added = *removed = 0;
+  const char* end = text + length;
+  const char* p = memchr(text, '\n', length);
+  while (p != NULL && ++p < end)
+  {
+    if (*p == '+') (*added)++;
+    else if (*p == '-') (*removed)++;
+    p = memchr(p, '\n', (size_t)(end-p));
+  }
+}
+
+void
+stash_index_entry_make(const stash_hunks* H, const stash_hunk* hunk,
+                       size_t offset, stash_index_entry* entry)
+{
+  const char* text = stash_hunk_text(H, hunk);
+  int old_start, old_count, new_start, new_count;
+  if (!stash_patch_header(text, hunk->length,
+                          &old_start, &old_count,
+                          &new_start, &new_count))
+    old_start = old_count = new_start = new_count = -1;
+  int added, removed;
+  count_lines(text, hunk->length, &added, &removed);
+  entry->offset    = offset;
+  entry->length    = hunk->length;
+  entry->old_start = old_start;
+  entry->old_count = old_count;
+  entry->new_start = new_start;
+  entry->new_count = new_count;
+  entry->checksum  = hunk->indexed ? hunk->checksum :
+                       stash_index_checksum(text, hunk->length);
+  entry->added     = added;
+  entry->removed   = removed;
+  entry->reserved  = 0;
+}
+
+static bool
+read_fully(int fd, void* data, size_t length)
+{
+  char* p = data;
+  while (length > 0)
+  {
+    ssize_t n = read(fd, p, length);
+    if (n <= 0) return false;
+    p      += n;
+    length -= n;
+  }
+  return true;
+}
+
+static bool
+write_fully(int fd, const void* data, size_t length)
+{
+  const char* p = data;
+  while (length > 0)
+  {
+    ssize_t n = write(fd, p, length);
+    if (n <= 0) return false;
+    p      += n;
+    length -= n;
+  }
+  return true;
+}
+
+/**
+   Read the index if it matches the stash file status s
+   entries: OUT: Allocated in stash_arena
+*/
+static bool
+index_load(const char* stash_name, const struct stat* s,
+           stash_index_entry** entries, int* count)
+{
+  char index_name[path_max+8];
+  stash_index_filename(stash_name, index_name);
+  int fd = open(index_name, O_RDONLY);
+  if (fd == -1) return false;
+
+  bool result = false;
+  stash_index_entry* E = NULL;
+  stash_index_header header;
+  if (!read_fully(fd, &header, sizeof(header)) ||
+      memcmp(header.magic, STASH_INDEX_MAGIC, 8) != 0 ||
+      header.version != STASH_INDEX_VERSION)
+  {
+    stash_log(STASH_DEBUG, "bad index: %s", index_name);
+    goto done;
+  }
+  if (header.size       != (uint64_t) s->st_size         ||
+      header.mtime_sec  != (int64_t)  s->st_mtim.tv_sec  ||
+      header.mtime_nsec != (int64_t)  s->st_mtim.tv_nsec)
+  {
+    stash_log(STASH_DEBUG, "stale index: %s", index_name);
+    goto done;
+  }
+  // A damaged count must not size the allocation
+  struct stat index_stat;
+  if (fstat(fd, &index_stat) != 0 ||
+      (uint64_t) index_stat.st_size !=
+      sizeof(header) + (uint64_t) header.count*sizeof(stash_index_entry))
+  {
+    stash_log(STASH_DEBUG, "bad index size: %s", index_name);
+    goto done;
+  }
+  E = stash_alloc(header.count * sizeof(stash_index_entry));
+  if (!read_fully(fd, E, header.count*sizeof(stash_index_entry)))
+  {
+    stash_log(STASH_DEBUG, "short index: %s", index_name);
+    goto done;
+  }
+  for (uint32_t i = 0; i < header.count; i++)
+    if (E[i].length > header.size ||
+        E[i].offset > header.size - E[i].length)
+    {
+      stash_log(STASH_DEBUG, "bad index entry: %s", index_name);
+      goto done;
+    }
+  stash_log(STASH_DEBUG, "using index: %s (%u hunks)",
+            index_name, header.count);
+  *entries = E;
+  *count   = header.count;
+  result = true;
+
+  done:
+  close(fd);
+  return result;
+}
+
+bool
+stash_index_read(const char* stash_name, const struct stat* s,
+                 stash_hunks* H)
+{
+  stash_index_entry* entries;
+  int count;
+  if (!index_load(stash_name, s, &entries, &count))
+    return false;
+  for (int i = 0; i < count; i++)
+  {
+    stash_hunk* hunk =
+      stash_hunks_add(H, entries[i].offset, entries[i].length);
+    hunk->checksum = entries[i].checksum;
+    hunk->indexed  = true;
+  }
+  return true;
+}
+
+bool
+stash_index_entries(const char* stash_name,
+                    stash_index_entry** entries, int* count)
+{
+  struct stat s;
+  CHECK(stat(stash_name, &s) == 0, "could not stat: %s: %s",
+        stash_name, strerror(errno));
+  if (index_load(stash_name, &s, entries, count))
+    return true;
+
+  stash_hunks H;
+  stash_hunks_init(&H);
+  if (!stash_hunks_map(&H, stash_name))
+    return false;
+  stash_index_entry* E = stash_alloc(H.count * sizeof(stash_index_entry));
+  for (int i = 0; i < H.count; i++)
+    stash_index_entry_make(&H, &H.hunk[i], H.hunk[i].offset, &E[i]);
+  *entries = E;
+  *count   = H.count;
+  stash_hunks_finalize(&H);
+  return true;
+}
+
+bool
+stash_index_write(const char* stash_name,
+                  const stash_index_entry* entries, int count)
+{
+  char index_name[path_max+8];
+  stash_index_filename(stash_name, index_name);
+  struct stat s;
+  if (stat(stash_name, &s) != 0) return false;
+
+  stash_index_header header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, STASH_INDEX_MAGIC, 8);
+  header.version    = STASH_INDEX_VERSION;
+  header.count      = count;
+  header.size       = s.st_size;
+  header.mtime_sec  = s.st_mtim.tv_sec;
+  header.mtime_nsec = s.st_mtim.tv_nsec;
+
+  // Readers never see a partial index
+  stash_file tmp;
+  if (!stash_file_temp(&tmp, "index", index_name))
+    return false;
+  bool b = write_fully(tmp.fd, &header, sizeof(header)) &&
+           write_fully(tmp.fd, entries, count*sizeof(stash_index_entry));
+  if (b)
+    b = stash_file_temp_commit(&tmp, index_name);
+  else
+    stash_temp_delete(&tmp);
+  if (!b)
+  {
+    stash_log(STASH_DEBUG, "could not write index: %s", index_name);
+    return false;
+  }
+  stash_log(STASH_DEBUG, "wrote index: %s (%i hunks)", index_name, count);
+  return true;
+}
+
+bool
+stash_index_write_hunks(const char* stash_name, stash_hunks* H)
+{
+  int count = H->live;
+  stash_index_entry* entries =
+    stash_alloc(count*sizeof(stash_index_entry));
+  int j = 0;
+  for (int i = 0; i < H->count; i++)
+  {
+    stash_hunk* hunk = &H->hunk[i];
+    if (hunk->removed) continue;
+    stash_index_entry_make(H, hunk, hunk->offset, &entries[j++]);
+  }
+  return stash_index_write(stash_name, entries, count);
+}
+
+bool
+stash_index_prepend(const char* stash_name, const struct stat* before,
+                    const stash_index_entry* entries, int count)
+{
+  stash_index_entry* old = NULL;
+  int old_count = 0;
+  if (before->st_size > 0 &&
+      !index_load(stash_name, before, &old, &old_count))
+  {
+    // Leave it to be rebuilt
+    stash_index_remove(stash_name);
+    return false;
+  }
+  int total = count + old_count;
+  stash_index_entry* all = stash_alloc(total * sizeof(stash_index_entry));
+  if (count > 0)
+    memcpy(all, entries, count*sizeof(stash_index_entry));
+  if (old_count > 0)
+    memcpy(all+count, old, old_count*sizeof(stash_index_entry));
+  return stash_index_write(stash_name, all, total);
+}
+
+bool
+stash_index_verify(const stash_hunks* H, const stash_hunk* hunk)
+{
+  if (!hunk->indexed) return true;
+  return hunk->checksum ==
+    stash_index_checksum(stash_hunk_text(H, hunk), hunk->length);
+}
+
+void
+stash_index_remove(const char* stash_name)
+{
+  char index_name[path_max+8];
+  stash_index_filename(stash_name, index_name);
+  unlink(index_name);
+}
@@ -0,0 +1,98 @@
+/*
+ * stash_index.h
+ *
+ *  Sidecar index of the hunks in a stash file: <file>.stash.idx
+ *  Lets pop find hunks without reading the whole stash.
+ *  The index is only trusted if it matches the stash file's
+ *  size and mtime, and is rebuilt lazily when it does not.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/stat.h>
+
+#include "stash_hunks.h"
+
+#define STASH_INDEX_MAGIC   "STASHIDX"
+#define STASH_INDEX_VERSION 2
+
+typedef struct
+{
+  char     magic[8];
+  uint32_t version;
+  uint32_t count;
+  /** The stash file this index describes */
+  uint64_t size;
+  int64_t  mtime_sec;
+  int64_t  mtime_nsec;
+} stash_index_header;
+
+typedef struct
+{
+  /** Byte range of the hunk in the stash file */
+  uint64_t offset;
+  uint64_t length;
+  /** From the "@@ -a,b +c,d @@" line */
+  int32_t  old_start;
+  int32_t  old_count;
+  int32_t  new_start;
+  int32_t  new_count;
+  uint32_t checksum;
+  /** The '+' and '-' lines of the hunk */
+  int32_t  added;
+  int32_t  removed;
+  uint32_t reserved;
+} stash_index_entry;
+
+void stash_index_filename(const char* stash_name, char* output);
+
+uint32_t stash_index_checksum(const char* data, size_t length);
+
+/** Describe a hunk in H that will be at offset in the stash file */
+void stash_index_entry_make(const stash_hunks* H,
+                            const stash_hunk* hunk, size_t offset,
+                            stash_index_entry* entry);
+
+/**
+   Add the hunks of the mapped stash to H from its index
+   s: The status of the stash file
+   @return False if there is no current index, quietly
+*/
+bool stash_index_read(const char* stash_name, const struct stat* s,
+                      stash_hunks* H);
+
+/**
+   Describe the hunks of the stash, from its index if it is current,
+   else by scanning the stash, which rebuilds the index
+   entries: OUT: In stash_arena, in hunk order
+   @return False if the stash cannot be read
+*/
+bool stash_index_entries(const char* stash_name,
+                         stash_index_entry** entries, int* count);
+
+/**
+   Write the index for the stash file as it is now on disk.
+   Failure is not an error: the index will be rebuilt later.
+*/
+bool stash_index_write(const char* stash_name,
+                       const stash_index_entry* entries, int count);
+
+/** Write the index for all hunks in H, which maps the stash */
+bool stash_index_write_hunks(const char* stash_name, stash_hunks* H);
+
+/**
+   After a push appended hunks to the stash, put their entries
+   first in the index, if it was current before the push
+   before: The status of the stash file before the push
+*/
+bool stash_index_prepend(const char* stash_name,
+                         const struct stat* before,
+                         const stash_index_entry* entries, int count);
+
+/** Check an indexed hunk against its recorded checksum */
+bool stash_index_verify(const stash_hunks* H, const stash_hunk* hunk);
+
+/** Remove the index, e.g., when it is found to be stale */
+void stash_index_remove(const char* stash_name);
@@ -10,11 +10,16 @@
 
 #include <stdarg.h>
 #include <stdio.h>
+#include <string.h>
 
 #include "util.h"
 #include "stash_file.h"
 
-stash_log_level stash_verbosity;
+__thread stash_log_level stash_verbosity = STASH_INFO;
+
+__thread FILE* stash_log_output = NULL;
+
+__thread char stash_error[STASH_ERROR_MAX] = "";
 
 static const char*
 stash_level_string(stash_log_level level)
@@ -53,6 +58,39 @@ stash_log(stash_log_level level, const char* format, ...)
   appendn (p, length, "%s", token);
   appendvn(p, length, format, ap);
   va_end(ap);
-  printf("%s\n", buffer);
-  fflush(stdout);
+  stash_print("%s\n", buffer);
+}
+
+void
+stash_print(const char* format, ...)
+{
+  FILE* fp = stash_log_output;
+  if (fp == NULL) fp = stdout;
+  va_list ap;
+  va_start(ap, format);
+  vfprintf(fp, format, ap);
+  va_end(ap);
+  if (fp == stdout) fflush(stdout);
+}
+
+void
+stash_fail(const char* format, ...)
+{
+  char buffer[path_max*3];
+  va_list ap;
+  va_start(ap, format);
+  vsnprintf(buffer, sizeof(buffer), format, ap);
+  va_end(ap);
+  stash_print("stash: %s\n", buffer);
+  stash_error_set(buffer);
+}
+
+void
+stash_error_set(const char* message)
+{
+  if (stash_error[0] != '\0') return;
+  size_t n = strlen(message);
+  if (n > STASH_ERROR_MAX-1) n = STASH_ERROR_MAX-1;
+  memcpy(stash_error, message, n);
+  stash_error[n] = '\0';
 }
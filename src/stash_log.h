@@ -7,6 +7,8 @@
 
 #pragma once
 
+#include <stdio.h>
+
 typedef enum
 {
   STASH_NULL  = 0,
@@ -17,6 +19,31 @@ typedef enum
   STASH_ERROR = 1,
 } stash_log_level;
 
-extern stash_log_level stash_verbosity;
+/** Each thread has its own: see stash_pool_run() */
+extern __thread stash_log_level stash_verbosity;
+
+/**
+   Where this thread prints messages: NULL means stdout.
+   Pool workers set this to buffer the output of each task.
+*/
+extern __thread FILE* stash_log_output;
 
 void stash_log(stash_log_level level, const char* format, ...);
+
+/** Print a message to stash_log_output */
+void stash_print(const char* format, ...)
+  __attribute__ ((format (printf, 1, 2)));
+
+/**
+   The first error reported by stash_fail() in this thread
+   since it was last cleared
+*/
+#define STASH_ERROR_MAX 1024
+extern __thread char stash_error[STASH_ERROR_MAX];
+
+/** Print an error, and record it in stash_error if it is the first */
+void stash_fail(const char* format, ...)
+  __attribute__ ((format (printf, 1, 2)));
+
+/** Record the message in stash_error if it is the first */
+void stash_error_set(const char* message);
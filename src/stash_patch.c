@@ -0,0 +1,464 @@
+/*
+ * stash_patch.c
+ *
+ *  In-process unified diff applier.
+ *  Replaces one patch process per hunk.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "stash.h"
+#include "stash_log.h"
+#include "stash_patch.h"
+
+/** Default like patch */
+__thread int stash_patch_fuzz = 2;
+
+static bool
+parse_range(const char** p, char sign, int* start, int* count)
+{
+  const char* s = *p;
+  while (*s == ' ') s++;
+  if (*s != sign) return false;
+  s++;
+  char* end;
+  errno = 0;
+  long v = strtol(s, &end, 10);
+  if (end == s || errno != 0 || v < 0) return false;
+  *start = (int) v;
+  *count = 1;
+  s = end;
+  if (*s == ',')
+  {
+    s++;
+    v = strtol(s, &end, 10);
+    if (end == s || errno != 0 || v < 0) return false;
+    *count = (int) v;
+    s = end;
+  }
+  *p = s;
+  return true;
+}
+
+bool
+stash_patch_header(const char* hunk, size_t length,
+                   int* old_start, int* old_count,
+                   int* new_start, int* new_count)
+{
+  // The hunk may not be NUL-terminated: copy the header line
+  char line[256];
+  const char* q = memchr(hunk, '\n', length);
+  size_t n = (q == NULL) ? length : (size_t)(q-hunk);
+  if (n >= sizeof(line)) n = sizeof(line)-1;
+  memcpy(line, hunk, n);
+  line[n] = '\0';
+
+  if (strncmp(line, "@@", 2) != 0) return false;
+  const char* p = line + 2;
+  if (!parse_range(&p, '-', old_start, old_count)) return false;
+  if (!parse_range(&p, '+', new_start, new_count)) return false;
+  while (*p == ' ') p++;
+  if (strncmp(p, "@@", 2) != 0) return false;
+  return true;
+}
+
+static inline void
+lines_ensure(stash_line** lines, int* capacity, int n)
+{
+  if (n <= *capacity) return;
+  int c = *capacity == 0 ? 1024 : *capacity;
+  while (c < n) c *= 2;
+  stash_line* t = realloc(*lines, (size_t) c * sizeof(stash_line));
+  if (t == NULL)
+    stash_abort("Failed to allocate memory!");
+  *lines = t;
+  *capacity = c;
+}
+
+void
+stash_lines_split(const char* data, size_t length,
+                  stash_line** lines, int* count, int* capacity)
+{
+  const char* p = data;
+  const char* end = data + length;
+  *count = 0;
+  while (p < end)
+  {
+    const char* q = memchr(p, '\n', (size_t)(end-p));
+    q = (q == NULL) ? end : q+1;
+    lines_ensure(lines, capacity, *count+1);
+    (*lines)[*count].data   = p;
+    (*lines)[*count].length = (size_t)(q-p);
+    (*count)++;
+    p = q;
+  }
+}
+
+bool
+stash_patch_load(stash_patch* patch, const char* text_name)
+{
+  memset(patch, 0, sizeof(*patch));
+  strcpy(patch->name, text_name);
+  int fd = open(text_name, O_RDONLY);
+  CHECK(fd != -1, "could not read: %s", text_name);
+  struct stat s;
+  int rc = fstat(fd, &s);
+  if (rc == 0 && s.st_size > 0)
+  {
+    void* p = mmap(NULL, s.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (p == MAP_FAILED) rc = -1;
+    else
+    {
+      patch->data   = p;
+      patch->length = s.st_size;
+    }
+  }
+  close(fd);
+  CHECK(rc == 0, "could not read: %s", text_name);
+  stash_lines_split(patch->data, patch->length,
+                    &patch->lines, &patch->count, &patch->capacity);
+  stash_log(STASH_DEBUG, "loaded %s: %i lines", text_name, patch->count);
+  return true;
+}
+
+/** The number of lines in the current text */
+static inline int
+text_count(const stash_patch* patch)
+{
+  return patch->done_count + patch->count - patch->cursor;
+}
+
+/** Line i of the current text */
+static inline const stash_line*
+text_line(const stash_patch* patch, int i)
+{
+  if (i < patch->done_count)
+    return &patch->done[i];
+  return &patch->lines[patch->cursor + i - patch->done_count];
+}
+
+static inline bool
+lines_equal(const stash_line* a, const stash_line* b)
+{
+  return a->length == b->length &&
+    memcmp(a->data, b->data, a->length) == 0;
+}
+
+/** Does old[0..n) match the text at line p? */
+static inline bool
+match_at(stash_patch* patch, int p, const stash_line* old, int n)
+{
+  if (p < 0 || p + n > text_count(patch)) return false;
+  for (int i = 0; i < n; i++)
+    if (!lines_equal(text_line(patch, p+i), &old[i]))
+      return false;
+  return true;
+}
+
+/**
+   Search outward from the expected line
+   @return The matching line or -1
+ */
+static int
+search(stash_patch* patch, int expected,
+       const stash_line* old, int n)
+{
+  int limit = text_count(patch) - n;
+  if (expected > limit) expected = limit;
+  if (expected < 0)     expected = 0;
+  for (int d = 0; expected-d >= 0 || expected+d <= limit; d++)
+  {
+    if (match_at(patch, expected+d, old, n))
+      return expected+d;
+    if (d > 0 && match_at(patch, expected-d, old, n))
+      return expected-d;
+  }
+  return -1;
+}
+
+/**
+   Split the hunk body into its old and new sides
+   @return False if the body is short of the header counts
+ */
+static bool
+parse_body(stash_patch* patch, const char* body, const char* end,
+           int old_count, int new_count, int* n_old, int* n_new)
+{
+  int need = old_count > new_count ? old_count : new_count;
+  lines_ensure(&patch->old, &patch->old_capacity, need+1);
+  lines_ensure(&patch->new, &patch->new_capacity, need+1);
+  *n_old = 0;
+  *n_new = 0;
+  // Which sides the previous line went to, for "\ No newline"
+  bool last_old = false, last_new = false;
+  const char* p = body;
+  while (p < end)
+  {
+    const char* q = memchr(p, '\n', (size_t)(end-p));
+    q = (q == NULL) ? end : q+1;
+    char c = *p;
+    bool done = (*n_old == old_count && *n_new == new_count);
+    if (c == '\\')
+    {
+      // The previous line has no newline
+      if (last_old) patch->old[*n_old-1].length--;
+      if (last_new) patch->new[*n_new-1].length--;
+      last_old = last_new = false;
+      p = q;
+      continue;
+    }
+    if (done) break;
+    stash_line line = { p+1, (size_t)(q-p-1) };
+    if (c == '\n')
+    {
+      // Context line stripped of its space, accept like patch
+      line.data   = p;
+      line.length = 1;
+    }
+    last_old = last_new = false;
+    if (c == ' ' || c == '\n' || c == '-')
+    {
+      if (*n_old == old_count) return false;
+      patch->old[(*n_old)++] = line;
+      last_old = true;
+    }
+    if (c == ' ' || c == '\n' || c == '+')
+    {
+      if (*n_new == new_count) return false;
+      patch->new[(*n_new)++] = line;
+      last_new = true;
+    }
+    if (!last_old && !last_new)
+      // Garbage before the hunk was complete
+      return false;
+    p = q;
+  }
+  return (*n_old == old_count && *n_new == new_count);
+}
+
+/** Count leading and trailing lines common to both sides */
+static void
+count_context(stash_line* a, int na, stash_line* b, int nb,
+              int* prefix, int* suffix)
+{
+  int i = 0;
+  while (i < na && i < nb && a[i].data == b[i].data) i++;
+  *prefix = i;
+  int j = 0;
+  while (j < na-i && j < nb-i &&
+         a[na-1-j].data == b[nb-1-j].data) j++;
+  *suffix = j;
+}
+
+static inline void
+done_append(stash_patch* patch, const stash_line* lines, int k)
+{
+  lines_ensure(&patch->done, &patch->done_capacity,
+               patch->done_count + k);
+  memcpy(&patch->done[patch->done_count], lines,
+         (size_t) k * sizeof(stash_line));
+  patch->done_count += k;
+}
+
+/**
+   A hunk before the done lines: start the pass again,
+   with the current text as the remaining lines
+*/
+static void
+rewind_text(stash_patch* patch)
+{
+  done_append(patch, &patch->lines[patch->cursor],
+              patch->count - patch->cursor);
+  stash_line* t = patch->lines;
+  int capacity  = patch->capacity;
+  patch->lines    = patch->done;
+  patch->capacity = patch->done_capacity;
+  patch->count    = patch->done_count;
+  patch->cursor   = 0;
+  patch->done          = t;
+  patch->done_capacity = capacity;
+  patch->done_count    = 0;
+}
+
+/** Replace n lines at p with the given lines */
+static void
+splice(stash_patch* patch, int p, int n,
+       const stash_line* lines, int k)
+{
+  if (p < patch->done_count)
+    rewind_text(patch);
+  // The lines before p are done
+  int skip = p - patch->done_count;
+  done_append(patch, &patch->lines[patch->cursor], skip);
+  done_append(patch, lines, k);
+  patch->cursor += skip + n;
+}
+
+/**
+   Copy a hunk that lacks its final newline, adding it
+   The copy is in stash_arena, so it outlives the patch
+*/
+static char*
+own_hunk(const char* hunk, size_t* length)
+{
+  char* copy = stash_alloc(*length+1);
+  memcpy(copy, hunk, *length);
+  copy[(*length)++] = '\n';
+  return copy;
+}
+
+bool
+stash_patch_apply(stash_patch* patch, const char* hunk, size_t length,
+                  bool reverse)
+{
+  int number = ++patch->hunks;
+  int old_start, old_count, new_start, new_count;
+  bool b = stash_patch_header(hunk, length, &old_start, &old_count,
+                              &new_start, &new_count);
+  CHECK(b, "hunk %i: bad header in: %s", number, patch->name);
+  if (hunk[length-1] != '\n')
+    hunk = own_hunk(hunk, &length);
+  const char* end  = hunk + length;
+  const char* body = (const char*) memchr(hunk, '\n', length) + 1;
+  int n_old, n_new;
+  b = parse_body(patch, body, end, old_count, new_count,
+                 &n_old, &n_new);
+  CHECK(b, "hunk %i: malformed hunk for: %s", number, patch->name);
+
+  stash_line* from = patch->old;
+  stash_line* to   = patch->new;
+  int start = old_start, n_from = n_old, n_to = n_new;
+  if (reverse)
+  {
+    from = patch->new; to = patch->old;
+    start = new_start; n_from = n_new; n_to = n_old;
+  }
+  // A zero-length range names the line before the hunk
+  int base = (n_from == 0) ? start : start-1;
+  int expected = base + patch->offset;
+
+  int prefix, suffix;
+  count_context(from, n_from, to, n_to, &prefix, &suffix);
+  int context = prefix > suffix ? prefix : suffix;
+
+  // As in patch, a side with less context than the other
+  // is at the start or end of the file, unless fuzzed away
+  int found = -1, fuzz;
+  int skip_head = 0, skip_tail = 0;
+  for (fuzz = 0; fuzz <= stash_patch_fuzz; fuzz++)
+  {
+    if (fuzz > 0 && fuzz > context) break;
+    int prefix_fuzz = fuzz + prefix - context;
+    int suffix_fuzz = fuzz + suffix - context;
+    skip_head = prefix_fuzz < 0 ? 0 :
+      (prefix_fuzz < prefix ? prefix_fuzz : prefix);
+    skip_tail = suffix_fuzz < 0 ? 0 :
+      (suffix_fuzz < suffix ? suffix_fuzz : suffix);
+    int n = n_from - skip_head - skip_tail;
+    const stash_line* old = from + skip_head;
+    if (prefix_fuzz < 0)
+      found = match_at(patch, 0, old, n) ? 0 : -1;
+    else if (suffix_fuzz < 0)
+      found = match_at(patch, text_count(patch)-n, old, n) ?
+        text_count(patch)-n : -1;
+    else
+      found = search(patch, expected+skip_head, old, n);
+    if (found >= 0) break;
+  }
+  if (found < 0)
+  {
+    stash_log(STASH_WARN, "hunk %i FAILED at %i in: %s",
+              number, expected+1, patch->name);
+    return false;
+  }
+
+  int n = n_from - skip_head - skip_tail;
+  splice(patch, found, n, to + skip_head, n_to - skip_head - skip_tail);
+  int delta = found - skip_head - expected;
+  patch->offset += delta + n_to - n_from;
+  patch->modified = true;
+
+  if (delta != 0 || fuzz > 0)
+    stash_log(STASH_INFO, "hunk %i succeeded at %i "
+              "(offset %i line%s, fuzz %i).",
+              number, found-skip_head+1, delta, plural(abs(delta)), fuzz);
+  else
+    stash_log(STASH_DEBUG, "hunk %i succeeded at %i.",
+              number, found+1);
+  return true;
+}
+
+/**
+   Write the current text: unchanged lines are contiguous in data,
+   so most of the text goes out in a few large writes
+*/
+static bool
+write_text(stash_patch* patch, FILE* fp)
+{
+  const char* run = NULL;
+  size_t run_length = 0;
+  int count = text_count(patch);
+  for (int i = 0; i <= count; i++)
+  {
+    const stash_line* line = (i < count) ? text_line(patch, i) : NULL;
+    if (line != NULL && run + run_length == line->data)
+    {
+      run_length += line->length;
+      continue;
+    }
+    if (run_length > 0 && fwrite(run, 1, run_length, fp) != run_length)
+      return false;
+    if (line == NULL) break;
+    run = line->data;
+    run_length = line->length;
+  }
+  return true;
+}
+
+bool
+stash_patch_save(stash_patch* patch)
+{
+  if (!patch->modified) return true;
+  bool result = true;
+  stash_log(STASH_DEBUG, "writing %s: %i lines",
+            patch->name, text_count(patch));
+  char target[path_max];
+  stash_file tmp;
+  bool b = stash_file_temp_replace(&tmp, "text", patch->name, target);
+  if (!b) return false;
+  b = stash_file_fdopen(&tmp, "w");
+  CHECK_GOTO(b, failed, "could not write: %s", patch->name);
+  b = write_text(patch, tmp.fp);
+  CHECK_GOTO(b, failed, "write error: %s", patch->name);
+  b = stash_file_temp_commit(&tmp, target);
+  CHECK(b, "could not write: %s", patch->name);
+  patch->modified = false;
+  return true;
+
+  failed:
+  stash_temp_delete(&tmp);
+  return result;
+}
+
+void
+stash_patch_finalize(stash_patch* patch)
+{
+  if (patch->data != NULL)
+    munmap(patch->data, patch->length);
+  free(patch->lines);
+  free(patch->done);
+  free(patch->old);
+  free(patch->new);
+  patch->data  = NULL;
+  patch->lines = NULL;
+  patch->done  = NULL;
+  patch->old   = NULL;
+  patch->new   = NULL;
+}
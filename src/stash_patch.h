@@ -0,0 +1,90 @@
+/*
+ * stash_patch.h
+ *
+ *  In-process unified diff applier.
+ *  The target file is mapped once, every hunk is applied in memory,
+ *  and the result is written once, to a new file renamed into place.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "util.h"
+
+/** A line of text: not NUL-terminated, includes any newline */
+typedef struct
+{
+  const char* data;
+  size_t length;
+} stash_line;
+
+typedef struct
+{
+  char name[path_max];
+  /** The original file contents, mapped */
+  char* data;
+  size_t length;
+  /**
+     The current text is done[0..done_count)
+     followed by lines[cursor..count).
+     The lines point into data or into hunks.
+     Hunks applied in file order only append to done,
+     so applying n hunks is one pass over the text.
+  */
+  stash_line* lines;
+  int count;
+  int capacity;
+  int cursor;
+  stash_line* done;
+  int done_count;
+  int done_capacity;
+  /** Line offset accumulated by previous hunks */
+  int offset;
+  /** Number of hunks attempted, for messages */
+  int hunks;
+  bool modified;
+  /** Scratch space for the two sides of the current hunk */
+  stash_line* old;
+  stash_line* new;
+  int old_capacity;
+  int new_capacity;
+} stash_patch;
+
+/**
+   Maximum number of context lines that may be ignored
+   when a hunk does not match exactly, like patch -F
+*/
+extern __thread int stash_patch_fuzz;
+
+/**
+   Split text into lines, each including its newline
+   lines, capacity: IN/OUT: Growable array, may be NULL/0
+ */
+void stash_lines_split(const char* data, size_t length,
+                       stash_line** lines, int* count, int* capacity);
+
+/** Parse the "@@ -a,b +c,d @@" line at the start of a hunk */
+bool stash_patch_header(const char* hunk, size_t length,
+                        int* old_start, int* old_count,
+                        int* new_start, int* new_count);
+
+bool stash_patch_load(stash_patch* patch, const char* text_name);
+
+/**
+   Apply one hunk in memory
+   hunk:    The hunk text, which must outlive the patch
+   reverse: if true, the hunk is removed from the text like patch -R
+ */
+bool stash_patch_apply(stash_patch* patch,
+                       const char* hunk, size_t length,
+                       bool reverse);
+
+/**
+   If any hunk was applied, write the text to a new file
+   and rename it over the original, keeping its mode
+*/
+bool stash_patch_save(stash_patch* patch);
+
+void stash_patch_finalize(stash_patch* patch);
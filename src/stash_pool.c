@@ -0,0 +1,311 @@
+/*
+ * stash_pool.c
+ *
+ *  Work-stealing over ranges of task indices:
+ *  each worker pops from the front of its own range,
+ *  and a thief takes the back half of the largest range.
+ */
+
+#include <pthread.h>
+#include <setjmp.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "stash.h"
+#include "stash_file.h"
+#include "stash_log.h"
+#include "stash_patch.h"
+#include "stash_pool.h"
+#include "stash_wc.h"
+
+__thread int stash_pool_jobs = 0;
+
+/**
+   The tasks not yet started by one worker: next..end-1
+   Changed under lock, but read without it by thieves:
+   see set() and size()
+*/
+typedef struct
+{
+  pthread_mutex_t lock;
+  int next;
+  int end;
+} pool_range;
+
+/** The buffered output of a finished task */
+typedef struct
+{
+  char* text;
+  size_t length;
+  bool done;
+  /** If the task failed: its stash_error, malloc'd */
+  char* error;
+} pool_output;
+
+typedef struct
+{
+  stash_pool_task task;
+  void* arg;
+  int count;
+  int workers;
+  pool_range* range;
+  /** Output is printed in task order: printed is the next to print */
+  pthread_mutex_t output_lock;
+  /** Workers wait for all threads to start: 1 to run, -1 to quit */
+  pthread_cond_t start;
+  int go;
+  /** The caller's output: see stash_log_output */
+  FILE* out;
+  /** The caller's settings, for the workers */
+  stash_log_level verbosity;
+  int fuzz;
+  bool fsync;
+  pool_output* output;
+  int printed;
+  int failed;
+} pool;
+
+typedef struct
+{
+  pool* P;
+  int id;
+} pool_worker;
+
+static inline void
+set(int* field, int value)
+{
+  __atomic_store_n(field, value, __ATOMIC_RELAXED);
+}
+
+/** The size of a range, read without its lock: only a hint */
+static inline int
+size(pool_range* R)
+{
+  return __atomic_load_n(&R->end,  __ATOMIC_RELAXED) -
+         __atomic_load_n(&R->next, __ATOMIC_RELAXED);
+}
+
+/** Take the next task of worker id */
+static bool
+take_own(pool* P, int id, int* index)
+{
+  pool_range* R = &P->range[id];
+  bool result = false;
+  pthread_mutex_lock(&R->lock);
+  if (R->next < R->end)
+  {
+    *index = R->next;
+    set(&R->next, R->next+1);
+    result = true;
+  }
+  pthread_mutex_unlock(&R->lock);
+  return result;
+}
+
+/** Steal the back half of the largest range into the range of id */
+static bool
+steal(pool* P, int id, int* index)
+{
+  while (true)
+  {
+    int victim = -1;
+    int most = 0;
+    for (int w = 0; w < P->workers; w++)
+    {
+      int n = size(&P->range[w]);
+      if (w != id && n > most)
+      {
+        victim = w;
+        most = n;
+      }
+    }
+    if (victim < 0) return false;
+
+    pool_range* V = &P->range[victim];
+    int first = 0, end = 0;
+    pthread_mutex_lock(&V->lock);
+    if (V->next < V->end)
+    {
+      first = V->next + (V->end - V->next) / 2;
+      end = V->end;
+      set(&V->end, first);
+    }
+    pthread_mutex_unlock(&V->lock);
+    if (first == end) continue; // The victim finished: look again
+
+    // Only this worker adds to its own empty range
+    pool_range* R = &P->range[id];
+    pthread_mutex_lock(&R->lock);
+    set(&R->next, first + 1);
+    set(&R->end,  end);
+    pthread_mutex_unlock(&R->lock);
+    *index = first;
+    return true;
+  }
+}
+
+/** Record the output of a task, and print all output now in order */
+static void
+finish(pool* P, int index, bool ok, char* text, size_t length)
+{
+  pthread_mutex_lock(&P->output_lock);
+  pool_output* O = &P->output[index];
+  O->text = text;
+  O->length = length;
+  O->done = true;
+  if (!ok)
+  {
+    P->failed++;
+    O->error = strdup(stash_error);
+  }
+  while (P->printed < P->count && P->output[P->printed].done)
+  {
+    O = &P->output[P->printed++];
+    fwrite(O->text, 1, O->length, P->out);
+    free(O->text);
+    O->text = NULL;
+  }
+  fflush(P->out);
+  pthread_mutex_unlock(&P->output_lock);
+}
+
+/** A stash_abort() in the task fails the task, not the process */
+static void
+run_task(pool* P, int index)
+{
+  char* text = NULL;
+  size_t length = 0;
+  stash_error[0] = '\0';
+  FILE* fp = open_memstream(&text, &length);
+  if (fp == NULL)
+  {
+    stash_error_set("Failed to allocate memory!");
+    finish(P, index, false, NULL, 0);
+    return;
+  }
+  stash_log_output = fp;
+  arena_mark mark = arena_save(&stash_arena);
+  jmp_buf jump;
+  volatile bool ok = false;
+  if (setjmp(jump) == 0)
+  {
+    stash_abort_jump = &jump;
+    ok = P->task(index, P->arg);
+  }
+  stash_abort_jump = NULL;
+  arena_restore(&stash_arena, mark);
+  stash_log_output = NULL;
+  fclose(fp);
+  finish(P, index, ok, text, length);
+}
+
+static void*
+worker(void* arg)
+{
+  pool_worker* W = arg;
+  pool* P = W->P;
+  pthread_mutex_lock(&P->output_lock);
+  while (P->go == 0)
+    pthread_cond_wait(&P->start, &P->output_lock);
+  int go = P->go;
+  pthread_mutex_unlock(&P->output_lock);
+  if (go < 0) return NULL;
+  arena_init(&stash_arena, 256*1024);
+  stash_verbosity  = P->verbosity;
+  stash_patch_fuzz = P->fuzz;
+  stash_file_fsync = P->fsync;
+  int index;
+  while (take_own(P, W->id, &index) || steal(P, W->id, &index))
+    run_task(P, index);
+  stash_wc_close();
+  arena_finalize(&stash_arena);
+  return NULL;
+}
+
+int
+stash_pool_workers()
+{
+  int jobs = stash_pool_jobs;
+  if (jobs <= 0)
+  {
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    jobs = cores > 0 ? (int) cores : 1;
+  }
+  return jobs;
+}
+
+int
+stash_pool_run(int count, stash_pool_task task, void* arg)
+{
+  int jobs = stash_pool_workers();
+  if (jobs > count) jobs = count;
+  int failed = 0;
+  if (jobs <= 1)
+  {
+    // No threads: output goes straight out
+    for (int i = 0; i < count; i++)
+      if (!task(i, arg))
+        failed++;
+    return failed;
+  }
+  stash_log(STASH_DEBUG, "running %i tasks on %i workers",
+            count, jobs);
+
+  pool P;
+  memset(&P, 0, sizeof(P));
+  P.task = task;
+  P.arg = arg;
+  P.out = stash_log_output != NULL ? stash_log_output : stdout;
+  P.verbosity = stash_verbosity;
+  P.fuzz  = stash_patch_fuzz;
+  P.fsync = stash_file_fsync;
+  P.count = count;
+  P.workers = jobs;
+  P.range  = stash_alloc(jobs * sizeof(pool_range));
+  P.output = stash_alloc(count * sizeof(pool_output));
+  pthread_mutex_init(&P.output_lock, NULL);
+  pthread_cond_init(&P.start, NULL);
+  pool_worker* W = stash_alloc(jobs * sizeof(pool_worker));
+  pthread_t* threads = stash_alloc(jobs * sizeof(pthread_t));
+  for (int w = 0; w < jobs; w++)
+  {
+    pthread_mutex_init(&P.range[w].lock, NULL);
+    P.range[w].next = (int) ((long) count * w / jobs);
+    P.range[w].end  = (int) ((long) count * (w+1) / jobs);
+    W[w].P = &P;
+    W[w].id = w;
+  }
+  fflush(stdout);
+  // No task runs unless every worker started
+  int started = 0;
+  int rc = 0;
+  while (started < jobs && rc == 0)
+  {
+    rc = pthread_create(&threads[started], NULL, worker, &W[started]);
+    if (rc == 0) started++;
+  }
+  if (rc != 0)
+    stash_fail("could not create thread: %s", strerror(rc));
+  pthread_mutex_lock(&P.output_lock);
+  P.go = (rc == 0) ? 1 : -1;
+  pthread_cond_broadcast(&P.start);
+  pthread_mutex_unlock(&P.output_lock);
+  for (int w = 0; w < started; w++)
+    pthread_join(threads[w], NULL);
+  for (int w = 0; w < jobs; w++)
+    pthread_mutex_destroy(&P.range[w].lock);
+  pthread_cond_destroy(&P.start);
+  pthread_mutex_destroy(&P.output_lock);
+  if (rc != 0) return count;
+  // The first error, in task order, is the caller's
+  for (int i = 0; i < count; i++)
+  {
+    if (P.output[i].error == NULL) continue;
+    if (stash_error[0] == '\0')
+      strcpy(stash_error, P.output[i].error);
+    free(P.output[i].error);
+  }
+  return P.failed;
+}
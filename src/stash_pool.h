@@ -0,0 +1,33 @@
+/*
+ * stash_pool.h
+ *
+ *  A bounded pool of worker threads for per-file work
+ */
+
+#pragma once
+
+#include <stdbool.h>
+
+/** The number of workers (-j): 0 means the number of cores */
+extern __thread int stash_pool_jobs;
+
+/** stash_pool_jobs, or the number of cores */
+int stash_pool_workers(void);
+
+/**
+   One task: index is from 0 to count-1
+   @return False if the task failed
+*/
+typedef bool (*stash_pool_task)(int index, void* arg);
+
+/**
+   Run count tasks on up to stash_pool_jobs threads.
+   Each worker starts with a contiguous block of tasks,
+   and steals half of the largest remaining block when idle.
+   The output of each task is buffered and printed in task order,
+   so the output does not depend on the number of workers.
+   Each worker has its own stash_arena, released after each task.
+   A stash_abort() in a task on a worker fails that task.
+   @return The number of tasks that failed
+*/
+int stash_pool_run(int count, stash_pool_task task, void* arg);
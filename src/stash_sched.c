@@ -0,0 +1,152 @@
+/*
+ * stash_sched.c
+ *
+ *  An event loop over the pipes of up to max children.
+ *  A job is finished when its pipe is at EOF: its child is then
+ *  reaped with a blocking wait, as it has closed its output.
+ *  SIGCHLD is not used: the host may ignore it, or another thread
+ *  or another caller of this loop may take it.
+ */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <errno.h>
+#include <poll.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#include "stash.h"
+#include "stash_exec.h"
+#include "stash_log.h"
+#include "stash_sched.h"
+#include "util.h"
+
+/** A running child */
+typedef struct
+{
+  /** The index of the job, or -1 if this slot is free */
+  int job;
+  stash_exec exec;
+  bool eof;
+  bool read_error;
+  int status;
+} sched_slot;
+
+static void
+slot_start(stash_sched_job* jobs, int j, sched_slot* slot)
+{
+  stash_sched_job* job = &jobs[j];
+  job->ok = false;
+  if (!stash_exec_spawn(&slot->exec, job->argv, STASH_EXEC_PIPE))
+    return;
+  slot->job = j;
+  slot->eof = false;
+  slot->read_error = false;
+}
+
+static void
+slot_read(stash_sched_job* jobs, sched_slot* slot)
+{
+  char chunk[64*1024];
+  ssize_t n = read(slot->exec.fd, chunk, sizeof(chunk));
+  if (n > 0)
+  {
+    stash_hunks_feed(jobs[slot->job].hunks, chunk, n);
+    return;
+  }
+  if (n < 0 && (errno == EINTR || errno == EAGAIN))
+    return;
+  if (n < 0) slot->read_error = true;
+  slot->eof = true;
+  close(slot->exec.fd);
+  slot->exec.fd = -1;
+}
+
+/**
+   Reap the child of a slot whose pipe is at EOF
+   @return True if the slot is now free
+*/
+static bool
+slot_finish(stash_sched_job* jobs, sched_slot* slot)
+{
+  if (!slot->eof) return false;
+  stash_sched_job* job = &jobs[slot->job];
+  stash_hunks_end(job->hunks);
+  stash_exec_wait(&slot->exec, &slot->status);
+  // Else the wait failed, e.g., as SIGCHLD is ignored: reported
+  bool waited = (slot->exec.pid == -1);
+  job->ok = waited && !slot->read_error &&
+            WIFEXITED(slot->status) && WEXITSTATUS(slot->status) == 0;
+  if (waited && !job->ok)
+  {
+    char reason[64];
+    if (slot->read_error)
+      strcpy(reason, "read error");
+    else
+      stash_exec_describe(slot->status, reason, sizeof(reason));
+    stash_print("stash: command failed: %s: %s\n",
+                slot->exec.command, reason);
+  }
+  slot->job = -1;
+  return true;
+}
+
+int
+stash_sched_run(stash_sched_job* jobs, int count, int max)
+{
+  if (count == 0) return 0;
+  if (max > count) max = count;
+  if (max < 1) max = 1;
+  stash_log(STASH_DEBUG, "running %i commands, %i at once",
+            count, max);
+
+  sched_slot* slots = stash_alloc(max * sizeof(sched_slot));
+  struct pollfd* fds = stash_alloc(max * sizeof(struct pollfd));
+  int* polled = stash_alloc(max * sizeof(int));
+  for (int s = 0; s < max; s++)
+    slots[s].job = -1;
+  int next = 0, running = 0;
+  while (next < count || running > 0)
+  {
+    for (int s = 0; s < max && next < count; s++)
+      if (slots[s].job == -1)
+      {
+        slot_start(jobs, next++, &slots[s]);
+        if (slots[s].job != -1) running++;
+      }
+    if (running == 0) continue; // All spawns failed
+
+    // Every running slot has an open pipe: slot_finish() frees
+    // a slot as soon as its pipe is at EOF
+    int n = 0;
+    for (int s = 0; s < max; s++)
+      if (slots[s].job != -1)
+      {
+        fds[n].fd = slots[s].exec.fd;
+        fds[n].events = POLLIN;
+        polled[n] = s;
+        n++;
+      }
+    int rc = poll(fds, n, -1);
+    if (rc == -1 && errno == EINTR) continue;
+    if (rc == -1)
+      stash_abort("poll failed: %s", strerror(errno));
+
+    for (int i = 0; i < n; i++)
+      if (fds[i].revents != 0)
+      {
+        sched_slot* slot = &slots[polled[i]];
+        slot_read(jobs, slot);
+        if (slot_finish(jobs, slot))
+          running--;
+      }
+  }
+
+  int failed = 0;
+  for (int j = 0; j < count; j++)
+    if (!jobs[j].ok) failed++;
+  return failed;
+}
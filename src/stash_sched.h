@@ -0,0 +1,31 @@
+/*
+ * stash_sched.h
+ *
+ *  Run many commands at once, parsing each output as it arrives
+ */
+
+#pragma once
+
+#include <stdbool.h>
+
+#include "stash_hunks.h"
+
+/** One command whose output is sliced into hunks */
+typedef struct
+{
+  /** NULL-terminated: see stash_exec_spawn() */
+  const char* const* argv;
+  /** OUT: The output */
+  stash_hunks* hunks;
+  /** OUT: True if the command succeeded */
+  bool ok;
+} stash_sched_job;
+
+/**
+   Run the jobs, keeping up to max children at once.
+   One thread waits on all the pipes with poll(),
+   and reaps each child once its pipe is at EOF.
+   Failures are reported for each job.
+   @return The number of jobs that failed
+*/
+int stash_sched_run(stash_sched_job* jobs, int count, int max);
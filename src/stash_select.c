@@ -0,0 +1,140 @@
+/*
+ * stash_select.c
+ *
+ *  Hunk selections
+ */
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "stash.h"
+#include "stash_log.h"
+#include "stash_select.h"
+#include "util.h"
+
+static void
+select_init(stash_select* S, int count)
+{
+  S->count = count;
+  S->bits = stash_alloc((count/64 + 1) * sizeof(uint64_t));
+}
+
+/** Set or clear hunks first..last, clipped to the hunks there are */
+static void
+select_range(stash_select* S, long first, long last, bool value)
+{
+  if (first < 1) first = 1;
+  if (last > S->count) last = S->count;
+  for (long id = first; id <= last; id++)
+  {
+    uint64_t bit = (uint64_t) 1 << (id%64);
+    if (value)
+      S->bits[id/64] |= bit;
+    else
+      S->bits[id/64] &= ~bit;
+  }
+}
+
+void
+stash_select_all(stash_select* S, int count)
+{
+  select_init(S, count);
+  select_range(S, 1, count, true);
+}
+
+bool
+stash_select_full(const stash_select* S)
+{
+  for (int id = 1; id <= S->count; id++)
+    if (!stash_select_contains(S, id))
+      return false;
+  return true;
+}
+
+void
+stash_select_range(stash_select* S, int count, int first, int last)
+{
+  select_init(S, count);
+  select_range(S, first, last, true);
+}
+
+/** Parse a positive hunk number at *p, advancing p */
+static bool
+parse_id(const char** p, long* result)
+{
+  errno = 0;
+  char* end;
+  long value = strtol(*p, &end, 10);
+  if (end == *p || errno != 0 || value < 1)
+    return false;
+  *p = end;
+  *result = value;
+  return true;
+}
+
+/** Parse one item of a spec, from p to end */
+static bool
+parse_item(stash_select* S, const char* p, const char* end)
+{
+  const char* item = p;
+  bool value = true;
+  if (*p == '^')
+  {
+    value = false;
+    p++;
+  }
+  long first, last;
+  if (p+1 == end && *p == '@')
+  {
+    select_range(S, 1, S->count, value);
+    return true;
+  }
+  CHECK(parse_id(&p, &first),
+        "bad hunk spec: '%.*s'", (int) (end-item), item);
+  last = first;
+  if (p < end && *p == '-')
+  {
+    p++;
+    if (p == end)
+      last = S->count;
+    else
+      CHECK(parse_id(&p, &last),
+            "bad hunk spec: '%.*s'", (int) (end-item), item);
+  }
+  CHECK(p == end, "bad hunk spec: '%.*s'", (int) (end-item), item);
+  select_range(S, first, last, value);
+  return true;
+}
+
+bool
+stash_select_parse(stash_select* S, const char* spec, int count)
+{
+  select_init(S, count);
+  if (spec[0] == '^')
+    select_range(S, 1, count, true);
+
+  const char* p = spec;
+  while (true)
+  {
+    const char* end = strchr(p, ',');
+    if (end == NULL) end = p + strlen(p);
+    if (end > p && !parse_item(S, p, end))
+    {
+      stash_select_finalize(S);
+      return false;
+    }
+    if (*end == '\0') break;
+    p = end + 1;
+  }
+  stash_log(STASH_DEBUG, "hunk spec: %s", spec);
+  return true;
+}
+
+void
+stash_select_finalize(stash_select* S)
+{
+  // The bits are in stash_arena
+  S->bits = NULL;
+  S->count = 0;
+}
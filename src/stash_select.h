@@ -0,0 +1,49 @@
+/*
+ * stash_select.h
+ *
+ *  Hunk selections: a hunk spec compiled once into a bitset
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/**
+   The hunks selected by a spec like "1,3-5,10-,^7" or "@"
+   Hunks are numbered from 1
+*/
+typedef struct
+{
+  uint64_t* bits;
+  /** The number of hunks */
+  int count;
+} stash_select;
+
+/**
+   Compile a comma-separated spec.  Each item is:
+   N, N-M, N- (to the last hunk), @ (all hunks),
+   or any of these after ^ to deselect them.
+   A spec that starts with ^ starts from all hunks.
+   count: The number of hunks: larger numbers are ignored
+*/
+bool stash_select_parse(stash_select* S, const char* spec, int count);
+
+/** Select all count hunks */
+void stash_select_all(stash_select* S, int count);
+
+/** Select hunks first..last of count hunks */
+void stash_select_range(stash_select* S, int count,
+                        int first, int last);
+
+static inline bool
+stash_select_contains(const stash_select* S, int id)
+{
+  if (id < 1 || id > S->count) return false;
+  return (S->bits[id/64] >> (id%64)) & 1;
+}
+
+/** @return True if every hunk is selected */
+bool stash_select_full(const stash_select* S);
+
+void stash_select_finalize(stash_select* S);
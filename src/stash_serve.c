@@ -0,0 +1,376 @@
+/*
+ * stash_serve.c
+ *
+ *  One thread polls the listening socket, the inotify events of
+ *  stash_cache, and SIGINT and SIGTERM from a signalfd.
+ *  Requests run one at a time in the server's main thread,
+ *  so chdir() to the client's directory is safe,
+ *  and their output is collected through stash_log_output.
+ */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE // for accept4()
+#endif
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#include "buffer.h"
+#include "stash.h"
+#include "stash_cache.h"
+#include "stash_log.h"
+#include "stash_serve.h"
+#include "util.h"
+
+/** The largest request: the arguments of one command */
+#define REQUEST_MAX (1024*1024)
+
+void
+stash_serve_default_socket(char* output)
+{
+  const char* dir = getenv("XDG_RUNTIME_DIR");
+  if (dir != NULL && dir[0] != '\0')
+    sprintf(output, "%s/stash.sock", dir);
+  else
+    sprintf(output, "/tmp/stash-%i.sock", (int) getuid());
+}
+
+static bool
+make_address(const char* socket_name, struct sockaddr_un* address)
+{
+  memset(address, 0, sizeof(*address));
+  address->sun_family = AF_UNIX;
+  CHECK(strlen(socket_name) < sizeof(address->sun_path),
+        "socket name too long: %s", socket_name);
+  strcpy(address->sun_path, socket_name);
+  return true;
+}
+
+static int
+connect_to(const struct sockaddr_un* address)
+{
+  int fd = socket(AF_UNIX, SOCK_STREAM|SOCK_CLOEXEC, 0);
+  if (fd == -1) return -1;
+  if (connect(fd, (const struct sockaddr*) address,
+              sizeof(*address)) != 0)
+  {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+static bool
+send_fully(int fd, const void* data, size_t length)
+{
+  const char* p = data;
+  while (length > 0)
+  {
+    ssize_t n = send(fd, p, length, MSG_NOSIGNAL);
+    if (n == -1 && errno == EINTR) continue;
+    if (n <= 0) return false;
+    p      += n;
+    length -= n;
+  }
+  return true;
+}
+
+/**
+   The socket must be ours: else another user could have made it,
+   and would read our commands
+   @return False if it exists and is not
+*/
+static bool
+socket_owned(const char* socket_name)
+{
+  struct stat s;
+  if (lstat(socket_name, &s) != 0) return true;
+  if (S_ISSOCK(s.st_mode) && s.st_uid == getuid()) return true;
+  stash_log(STASH_WARN, "not our socket: %s", socket_name);
+  return false;
+}
+
+/** @return True if the client is the same user as the server */
+static bool
+peer_allowed(int fd)
+{
+  struct ucred credentials;
+  socklen_t length = sizeof(credentials);
+  if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED,
+                 &credentials, &length) != 0)
+    return false;
+  return credentials.uid == getuid();
+}
+
+static int
+listen_on(const char* socket_name)
+{
+  struct sockaddr_un address;
+  if (!make_address(socket_name, &address)) return -1;
+  if (!socket_owned(socket_name))
+  {
+    stash_print("stash: could not listen on: %s: "
+                "owned by another user\n", socket_name);
+    return -1;
+  }
+  int fd = connect_to(&address);
+  if (fd != -1)
+  {
+    close(fd);
+    stash_print("stash: already serving on: %s\n", socket_name);
+    return -1;
+  }
+  // Left by a server that did not exit cleanly
+  unlink(socket_name);
+  fd = socket(AF_UNIX, SOCK_STREAM|SOCK_CLOEXEC, 0);
+  // Only this user may connect
+  mode_t mask = umask(077);
+  bool bound = fd != -1 &&
+    bind(fd, (struct sockaddr*) &address, sizeof(address)) == 0 &&
+    chmod(socket_name, 0600) == 0;
+  umask(mask);
+  if (!bound || listen(fd, 16) != 0)
+  {
+    stash_print("stash: could not listen on: %s: %s\n",
+                socket_name, strerror(errno));
+    if (fd != -1) close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+/**
+   Read the request
+   data: OUT: malloc'd
+   @return False on error or timeout
+*/
+static bool
+read_request(int fd, char** data, size_t* length)
+{
+  buffer B;
+  buffer_init(&B, 4096);
+  char chunk[4096];
+  bool result = true;
+  while (true)
+  {
+    ssize_t n = read(fd, chunk, sizeof(chunk));
+    if (n == -1 && errno == EINTR) continue;
+    if (n == 0) break;
+    if (n < 0 || B.length + n > REQUEST_MAX)
+    {
+      result = false;
+      break;
+    }
+    buffer_append_data(&B, chunk, (int) n);
+  }
+  if (!result)
+  {
+    buffer_finalize(&B);
+    return false;
+  }
+  *data   = B.data;
+  *length = B.length;
+  return true;
+}
+
+/**
+   Split the request into the directory and arguments
+   argv: OUT: In stash_arena, with argv[0] = "stash"
+*/
+static bool
+parse_request(char* data, size_t length,
+              const char** dir, int* argc, char*** argv)
+{
+  if (length == 0 || data[length-1] != '\0') return false;
+  int count = 0;
+  for (size_t i = 0; i < length; i++)
+    if (data[i] == '\0') count++;
+  *dir = data;
+  char** A = stash_alloc((count+1) * sizeof(char*));
+  A[0] = "stash";
+  int c = 1;
+  for (char* p = data + strlen(data) + 1; p < data+length;
+       p += strlen(p) + 1)
+    A[c++] = p;
+  A[c] = NULL;
+  *argc = c;
+  *argv = A;
+  return true;
+}
+
+/** Run one request on the connection */
+static void
+serve_one(int fd, int home, stash_serve_handler handler)
+{
+  // A client that sends nothing must not stall the server
+  struct timeval timeout = { 10, 0 };
+  setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+  arena_mark mark = arena_save(&stash_arena);
+  char* request = NULL;
+  size_t length;
+  const char* dir;
+  int argc;
+  char** argv;
+  int status = EXIT_FAILURE;
+  char* text = NULL;
+  size_t text_length = 0;
+  FILE* fp = open_memstream(&text, &text_length);
+  if (fp == NULL)
+    stash_abort("Failed to allocate memory!");
+  stash_log_output = fp;
+
+  if (!read_request(fd, &request, &length) ||
+      !parse_request(request, length, &dir, &argc, &argv))
+    stash_print("stash: bad request\n");
+  else if (chdir(dir) != 0)
+    stash_print("stash: could not chdir: %s: %s\n",
+                dir, strerror(errno));
+  else
+  {
+    stash_cache_events();
+    status = handler(argc, argv);
+  }
+
+  stash_log_output = NULL;
+  fclose(fp);
+  if (fchdir(home) != 0)
+    stash_abort("could not return to server directory: %s",
+                strerror(errno));
+  char trailer[32];
+  int n = sprintf(trailer, "%c%i", '\0', status);
+  if (!send_fully(fd, text, text_length) ||
+      !send_fully(fd, trailer, n))
+    stash_log(STASH_DEBUG, "client went away");
+  free(text);
+  free(request);
+  arena_restore(&stash_arena, mark);
+}
+
+bool
+stash_serve(const char* socket_name, stash_serve_handler handler)
+{
+  int listener = listen_on(socket_name);
+  if (listener == -1) return false;
+  int home = open(".", O_RDONLY|O_DIRECTORY|O_CLOEXEC);
+  if (home == -1)
+    stash_abort("could not open working directory: %s",
+                strerror(errno));
+
+  sigset_t mask, old;
+  sigemptyset(&mask);
+  sigaddset(&mask, SIGINT);
+  sigaddset(&mask, SIGTERM);
+  pthread_sigmask(SIG_BLOCK, &mask, &old);
+  int sfd = signalfd(-1, &mask, SFD_CLOEXEC);
+  if (sfd == -1)
+    stash_abort("could not make signalfd: %s", strerror(errno));
+  int ifd = stash_cache_start();
+
+  stash_log(STASH_INFO, "serving on: %s", socket_name);
+  struct pollfd fds[3] =
+    { { listener, POLLIN, 0 }, { ifd, POLLIN, 0 }, { sfd, POLLIN, 0 } };
+  while (true)
+  {
+    int rc = poll(fds, 3, -1);
+    if (rc == -1 && errno == EINTR) continue;
+    if (rc == -1)
+      stash_abort("poll failed: %s", strerror(errno));
+    if (fds[2].revents != 0)
+    {
+      // Consume the signal, so it is not delivered when unblocked
+      struct signalfd_siginfo info;
+      if (read(sfd, &info, sizeof(info)) == sizeof(info))
+        break;
+    }
+    if (fds[1].revents != 0)
+      stash_cache_events();
+    if (fds[0].revents != 0)
+    {
+      int fd = accept4(listener, NULL, NULL, SOCK_CLOEXEC);
+      if (fd == -1) continue;
+      if (!peer_allowed(fd))
+      {
+        stash_log(STASH_WARN, "refused a client of another user");
+        close(fd);
+        continue;
+      }
+      serve_one(fd, home, handler);
+      close(fd);
+    }
+  }
+
+  stash_log(STASH_INFO, "stopped serving: %s", socket_name);
+  stash_cache_finalize();
+  close(listener);
+  unlink(socket_name);
+  close(home);
+  close(sfd);
+  pthread_sigmask(SIG_SETMASK, &old, NULL);
+  return true;
+}
+
+int
+stash_serve_request(const char* socket_name,
+                    int argc, char* const argv[])
+{
+  struct sockaddr_un address;
+  if (!make_address(socket_name, &address)) return -1;
+  if (!socket_owned(socket_name)) return -1;
+  int fd = connect_to(&address);
+  if (fd == -1)
+  {
+    stash_log(STASH_DEBUG, "no server on: %s", socket_name);
+    return -1;
+  }
+
+  char dir[path_max];
+  bool b = (getcwd(dir, path_max) != NULL) &&
+           send_fully(fd, dir, strlen(dir)+1);
+  for (int i = 0; b && i < argc; i++)
+    b = send_fully(fd, argv[i], strlen(argv[i])+1);
+  shutdown(fd, SHUT_WR);
+
+  // The output, then NUL and the status
+  char chunk[64*1024];
+  char status[32] = "";
+  size_t s = 0;
+  bool trailer = false;
+  while (b)
+  {
+    ssize_t n = read(fd, chunk, sizeof(chunk));
+    if (n == -1 && errno == EINTR) continue;
+    if (n <= 0) break;
+    char* p = chunk;
+    if (!trailer)
+    {
+      char* nul = memchr(chunk, '\0', n);
+      size_t k = nul == NULL ? (size_t) n : (size_t) (nul - chunk);
+      fwrite(chunk, 1, k, stdout);
+      if (nul == NULL) continue;
+      trailer = true;
+      p = nul + 1;
+    }
+    for (; p < chunk + n && s < sizeof(status)-1; p++)
+      status[s++] = *p;
+  }
+  fflush(stdout);
+  close(fd);
+  status[s] = '\0';
+  if (!trailer || s == 0)
+  {
+    stash_print("stash: no reply from server: %s\n", socket_name);
+    return EXIT_FAILURE;
+  }
+  return atoi(status);
+}
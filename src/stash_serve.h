@@ -0,0 +1,42 @@
+/*
+ * stash_serve.h
+ *
+ *  stash serve: a long-lived process that runs stash commands
+ *  for thin clients over a Unix domain socket,
+ *  keeping BASE texts, hunks and wc.db open between commands.
+ *
+ *  A request is the client's working directory and then the
+ *  command line arguments, each NUL-terminated, then EOF.
+ *  The reply is the output of the command, then a NUL,
+ *  then the exit status in decimal.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+
+/**
+   Run one command, like main()
+   @return The exit status
+*/
+typedef int (*stash_serve_handler)(int argc, char* argv[]);
+
+/** The socket if none is given: in XDG_RUNTIME_DIR, else /tmp */
+void stash_serve_default_socket(char* output);
+
+/**
+   Serve requests on the socket one at a time,
+   until SIGINT or SIGTERM.
+   The socket is made mode 0600, and only clients of the same user
+   are served.
+*/
+bool stash_serve(const char* socket_name, stash_serve_handler handler);
+
+/**
+   Send a command to the server, printing its output as it arrives
+   argv: The arguments after the program name
+   @return The exit status, or -1 if there is no server,
+           or the socket is not this user's
+*/
+int stash_serve_request(const char* socket_name,
+                        int argc, char* const argv[]);
@@ -0,0 +1,211 @@
+/*
+ * stash_wc.c
+ *
+ *  Direct read-only access to the Subversion working copy
+ *  administrative area (.svn/wc.db and .svn/pristine)
+ */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE // for memmem()
+#endif
+
+#include "config.h"
+
+#include <libgen.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#if HAVE_SQLITE3_H && HAVE_LIBSQLITE3
+#include <sqlite3.h>
+#define STASH_WC_DB 1
+#else
+#define STASH_WC_DB 0
+#endif
+
+#include "stash_log.h"
+#include "stash_wc.h"
+
+bool
+stash_wc_root(const char* text_name, char* root, char* relpath)
+{
+  char t[path_max];
+  strcpy(t, text_name);
+  char* d = dirname(t);
+  char dir[path_max];
+  if (realpath(d, dir) == NULL) return false;
+
+  char probe[path_max+16];
+  strcpy(root, dir);
+  while (true)
+  {
+    sprintf(probe, "%s/.svn/wc.db", root);
+    if (access(probe, R_OK) == 0) break;
+    char* slash = strrchr(root, '/');
+    if (slash == NULL || slash == root)
+      return false;
+    *slash = '\0';
+  }
+
+  strcpy(t, text_name);
+  const char* base = basename(t);
+  size_t n = strlen(root);
+  if (dir[n] == '/')
+    sprintf(relpath, "%s/%s", dir+n+1, base);
+  else
+    strcpy(relpath, base);
+  return true;
+}
+
+#if STASH_WC_DB
+
+/**
+   The open wc.db, kept for subsequent lookups in the same root.
+   Each thread has its own connection.
+*/
+static __thread sqlite3* db = NULL;
+static __thread char db_root[path_max] = "";
+
+static bool
+db_open(const char* root)
+{
+  if (db != NULL && strcmp(root, db_root) == 0)
+    return true;
+  if (db != NULL)
+  {
+    sqlite3_close(db);
+    db = NULL;
+  }
+  char path[path_max+16];
+  sprintf(path, "%s/.svn/wc.db", root);
+  int rc = sqlite3_open_v2(path, &db, SQLITE_OPEN_READONLY, NULL);
+  if (rc != SQLITE_OK)
+  {
+    stash_log(STASH_DEBUG, "could not open: %s: %s",
+              path, sqlite3_errmsg(db));
+    sqlite3_close(db);
+    db = NULL;
+    return false;
+  }
+  sqlite3_busy_timeout(db, 1000);
+  strcpy(db_root, root);
+  return true;
+}
+
+/** Properties under which the working text is not the pristine */
+static const char* translating_props[] =
+  { "svn:keywords", "svn:eol-style", "svn:special", "svn:mime-type",
+    NULL };
+
+static bool
+props_translate(const void* props, int length)
+{
+  if (props == NULL) return false;
+  for (int i = 0; translating_props[i] != NULL; i++)
+    if (memmem(props, (size_t) length, translating_props[i],
+               strlen(translating_props[i])) != NULL)
+      return true;
+  return false;
+}
+
+/**
+   The top node is the working node:
+   it is the BASE node only if its op_depth is 0
+*/
+static const char* node_query =
+  "SELECT op_depth, presence, kind, checksum, properties "
+  "FROM nodes WHERE wc_id = 1 AND local_relpath = ?1 "
+  "ORDER BY op_depth DESC LIMIT 1";
+
+static const char* actual_query =
+  "SELECT properties FROM actual_node "
+  "WHERE wc_id = 1 AND local_relpath = ?1";
+
+bool
+stash_wc_lookup(const char* text_name, stash_wc_node* node)
+{
+  if (!stash_wc_root(text_name, node->root, node->relpath))
+    return false;
+  if (!db_open(node->root))
+    return false;
+
+  bool result = false;
+  sqlite3_stmt* stmt = NULL;
+  int rc = sqlite3_prepare_v2(db, node_query, -1, &stmt, NULL);
+  if (rc != SQLITE_OK) goto error;
+  sqlite3_bind_text(stmt, 1, node->relpath, -1, SQLITE_STATIC);
+  rc = sqlite3_step(stmt);
+  if (rc != SQLITE_ROW)
+  {
+    stash_log(STASH_DEBUG, "not in wc.db: %s", node->relpath);
+    goto done;
+  }
+  int op_depth = sqlite3_column_int(stmt, 0);
+  const char* presence = (const char*) sqlite3_column_text(stmt, 1);
+  const char* kind     = (const char*) sqlite3_column_text(stmt, 2);
+  const char* checksum = (const char*) sqlite3_column_text(stmt, 3);
+  if (op_depth != 0 ||
+      presence == NULL || strcmp(presence, "normal") != 0 ||
+      kind     == NULL || strcmp(kind,     "file")   != 0 ||
+      checksum == NULL || strncmp(checksum, "$sha1$", 6) != 0 ||
+      strlen(checksum+6) != 40)
+  {
+    stash_log(STASH_DEBUG, "no BASE node in wc.db: %s", node->relpath);
+    goto done;
+  }
+  strcpy(node->sha1, checksum+6);
+  node->translated =
+    props_translate(sqlite3_column_blob (stmt, 4),
+                    sqlite3_column_bytes(stmt, 4));
+  sqlite3_finalize(stmt);
+  stmt = NULL;
+
+  // Local property changes may also translate the text
+  rc = sqlite3_prepare_v2(db, actual_query, -1, &stmt, NULL);
+  if (rc != SQLITE_OK) goto error;
+  sqlite3_bind_text(stmt, 1, node->relpath, -1, SQLITE_STATIC);
+  if (sqlite3_step(stmt) == SQLITE_ROW &&
+      props_translate(sqlite3_column_blob (stmt, 0),
+                      sqlite3_column_bytes(stmt, 0)))
+    node->translated = true;
+  result = true;
+  goto done;
+
+  error:
+  stash_log(STASH_DEBUG, "wc.db query failed: %s", sqlite3_errmsg(db));
+  done:
+  sqlite3_finalize(stmt);
+  return result;
+}
+
+void
+stash_wc_close()
+{
+  if (db == NULL) return;
+  sqlite3_close(db);
+  db = NULL;
+  db_root[0] = '\0';
+}
+
+#else
+
+bool
+stash_wc_lookup(const char* text_name, stash_wc_node* node)
+{
+  // Built without SQLite
+  return false;
+}
+
+void
+stash_wc_close()
+{}
+
+#endif
+
+void
+stash_wc_pristine(const stash_wc_node* node, char* output)
+{
+  sprintf(output, "%s/.svn/pristine/%.2s/%s.svn-base",
+          node->root, node->sha1, node->sha1);
+}
@@ -0,0 +1,44 @@
+/*
+ * stash_wc.h
+ *
+ *  Direct read-only access to the Subversion working copy
+ *  administrative area (.svn/wc.db and .svn/pristine)
+ */
+
+#pragma once
+
+#include <stdbool.h>
+
+#include "util.h"
+
+/** A file's BASE node in its working copy */
+typedef struct
+{
+  /** The working copy root, containing .svn */
+  char root[path_max];
+  /** The file relative to root */
+  char relpath[path_max];
+  /** SHA-1 of the BASE text in hex */
+  char sha1[41];
+  /** True if svn translates the text (keywords, eol-style, ...) */
+  bool translated;
+} stash_wc_node;
+
+/**
+   Find the working copy root above the file
+   root, relpath: OUT: Absolute root, and file relative to it
+   @return False if the file is not in a working copy
+ */
+bool stash_wc_root(const char* text_name, char* root, char* relpath);
+
+/**
+   Look up the BASE node of this file in wc.db
+   @return False quietly if it has no usable BASE node
+ */
+bool stash_wc_lookup(const char* text_name, stash_wc_node* node);
+
+/** Close this thread's wc.db, if open */
+void stash_wc_close(void);
+
+/** The path of the pristine BASE text for this node */
+void stash_wc_pristine(const stash_wc_node* node, char* output);
@@ -26,7 +26,7 @@ file_size(const char* filename, size_t* length)
   int rc = stat(filename, &s);
   if (rc != 0)
   {
-    printf("file_size(): could not stat: %s\n", filename);
+    stash_print("file_size(): could not stat: %s\n", filename);
     return false;
   }
 
@@ -41,7 +41,7 @@ file_size_fp(FILE* fp, size_t* length)
   int rc = fstat(fileno(fp), &s);
   if (rc != 0)
   {
-    printf("file_size_fp(): could not fstat!\n");
+    stash_print("file_size_fp(): could not fstat!\n");
     return false;
   }
 
@@ -55,7 +55,7 @@ slurp(const char* filename)
   FILE* fp = fopen(filename, "r");
   if (fp == NULL)
   {
-    printf("slurp(): could not read from: %s\n", filename);
+    stash_print("slurp(): could not read from: %s\n", filename);
     return NULL;
   }
 
@@ -72,14 +72,14 @@ slurp_fp(const char* filename, FILE* fp)
   bool b = file_size_fp(fp, &length);
   if (!b)
   {
-    printf("slurp_fp(): could not stat: %s\n", filename);
+    stash_print("slurp_fp(): could not stat: %s\n", filename);
     return NULL;
   }
 
   char* result = malloc(length+1);
   if (result == NULL)
   {
-    printf("slurp(): could not allocate memory for: %s\n", filename);
+    stash_print("slurp(): could not allocate memory for: %s\n", filename);
     return NULL;
   }
 
@@ -87,7 +87,7 @@ slurp_fp(const char* filename, FILE* fp)
   size_t actual = fread(p, sizeof(char), length, fp);
   if (actual != length)
   {
-    printf("could not read all %zi bytes from file: %s\n",
+    stash_print("could not read all %zi bytes from file: %s\n",
            length, filename);
     free(result);
     return NULL;
@@ -128,6 +128,27 @@ valgrind_assert_failed(const char* file, int line)
   exit(EXIT_FAILURE);
 }
 
+uint64_t
+hash_data(const char* data, size_t length)
+{
+  uint64_t h = 14695981039346656037ull;
+  size_t i = 0;
+  for (; i + 8 <= length; i += 8)
+  {
+    uint64_t w;
+    memcpy(&w, data+i, 8);
+    h ^= w;
+    h *= 1099511628211ull;
+    h ^= h >> 29;
+  }
+  for (; i < length; i++)
+  {
+    h ^= (unsigned char) data[i];
+    h *= 1099511628211ull;
+  }
+  return h ^ length;
+}
+
 bool
 getenv_string(const char* key, char** value)
 {
@@ -158,7 +179,7 @@ mkdirp(const char* path)
     int rc = mkdir(done, mode);
     if (rc != 0 && errno != EEXIST)
     {
-      printf("could not mkdir: '%s'\n", done);
+      stash_print("could not mkdir: '%s'\n", done);
       perror("stash");
       return false;
     }
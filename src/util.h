@@ -8,8 +8,11 @@
 #include <assert.h>
 #include <stdarg.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 
+#include "stash_log.h"
+
 /** Used for filenames */
 #define path_max 4096
 
@@ -22,7 +25,7 @@
 
 #define FAIL(format, args...)                   \
   do {                                          \
-    printf("stash: " format "\n", ## args);     \
+    stash_fail(format, ## args);                \
     return false;                               \
   } while (0);
 
@@ -35,7 +38,7 @@
 
 #define FAIL_GOTO(label, format, args...)       \
   do {                                          \
-    printf("stash: " format "\n", ## args);     \
+    stash_fail(format, ## args);                \
     result = false;                             \
     goto label;                                 \
   } while (0);
@@ -109,6 +112,12 @@ void valgrind_assert_failed_msg(const char *file, int line,
 #define valgrind_fail(msg...) \
   valgrind_assert_failed_msg(__FILE__, __LINE__, ## msg)
 
+/**
+   FNV-1a style, 64-bit, taking 8 bytes per step:
+   fast enough to hash whole files on every command
+*/
+uint64_t hash_data(const char* data, size_t length);
+
 bool getenv_string(const char* key, char** value);
 
 bool mkdirp(const char* path);
@@ -0,0 +1,110 @@
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <libstash.h>
+
+/** Count the lines logged, and keep the last */
+static int  lines = 0;
+static char last[1024];
+
+static void
+log_line(void* data, const char* line)
+{
+  lines++;
+  snprintf(last, sizeof(last), "%s", line);
+}
+
+/** Answer every prompt with the key in data */
+static int
+answer(void* data, int number, const char* hunk, size_t length,
+       const char* choices)
+{
+  assert(strchr(choices, *(char*) data) != NULL);
+  assert(strncmp(hunk, "@@", 2) == 0);
+  return *(char*) data;
+}
+
+static void
+put(const char* name, const char* text)
+{
+  FILE* fp = fopen(name, "w");
+  assert(fp != NULL);
+  fputs(text, fp);
+  fclose(fp);
+}
+
+static char*
+get(const char* name)
+{
+  static char t[1024];
+  FILE* fp = fopen(name, "r");
+  assert(fp != NULL);
+  size_t n = fread(t, 1, sizeof(t)-1, fp);
+  t[n] = '\0';
+  fclose(fp);
+  return t;
+}
+
+static const char* hunk =
+  "@@ -1,3 +1,4 @@\n"
+  " a\n"
+  "+x\n"
+  " b\n"
+  " c\n";
+
+int
+main()
+{
+  char dir[] = "/tmp/libstash-1.XXXXXX";
+  assert(mkdtemp(dir) != NULL);
+  assert(chdir(dir) == 0);
+
+  stash_ctx* ctx = stash_ctx_new();
+  assert(ctx != NULL);
+  stash_ctx_set_log(ctx, log_line, NULL);
+
+  assert(stash_ctx_push(ctx, NULL, "@") == STASH_INVALID);
+
+  // Pop all
+  put("f", "a\nb\nc\n");
+  put("f.stash", hunk);
+  assert(stash_ctx_pop(ctx, "f", "@") == STASH_OK);
+  assert(strcmp(get("f"), "a\nx\nb\nc\n") == 0);
+  assert(strcmp(stash_ctx_error(ctx), "") == 0);
+  assert(lines > 0);
+
+  // A conflict changes nothing, and is the error
+  put("f", "q\nr\ns\n");
+  put("f.stash", hunk);
+  stash_ctx_set_fuzz(ctx, 0);
+  assert(stash_ctx_pop(ctx, "f", "@") == STASH_FAILED);
+  printf("error: %s\n", stash_ctx_error(ctx));
+  assert(strstr(stash_ctx_error(ctx), "conflict") != NULL);
+  assert(strcmp(get("f"), "q\nr\ns\n") == 0);
+
+  // Interactive, through the prompt
+  put("f", "a\nb\nc\n");
+  char key = 'p';
+  stash_ctx_set_prompt(ctx, answer, &key);
+  assert(stash_ctx_pop(ctx, "f", NULL) == STASH_OK);
+  assert(strcmp(get("f"), "a\nx\nb\nc\n") == 0);
+  printf("last: %s\n", last);
+
+  // List, from the index
+  put("f.stash", hunk);
+  assert(stash_ctx_list(ctx, "f", "json") == STASH_OK);
+  printf("list: %s\n", last);
+  assert(strstr(last, "\"added\":1,\"removed\":0") != NULL);
+  assert(stash_ctx_list(ctx, "f", "xml") == STASH_FAILED);
+
+  stash_ctx_free(ctx);
+  unlink("f");
+  unlink("f.stash");
+  unlink("f.stash.idx");
+  rmdir(dir);
+  printf("OK\n");
+  return 0;
+}
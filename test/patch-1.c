@@ -0,0 +1,54 @@
+
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <stash_patch.h>
+#include <util.h>
+
+static const char* hunk =
+  "@@ -2,3 +2,3 @@\n"
+  " b\n"
+  "-c\n"
+  "+C\n"
+  " d\n";
+
+int
+main()
+{
+  const char* name = "patch-1.txt";
+  FILE* fp = fopen(name, "w");
+  // Two extra lines at the top: the hunk applies at offset 2
+  fprintf(fp, "x\ny\na\nb\nc\nd\n");
+  fclose(fp);
+
+  stash_patch patch;
+  bool b;
+  b = stash_patch_load(&patch, name);
+  assert(b);
+  b = stash_patch_apply(&patch, hunk, strlen(hunk), false);
+  assert(b);
+  assert(patch.offset == 2);
+  b = stash_patch_save(&patch);
+  assert(b);
+  stash_patch_finalize(&patch);
+
+  char* s = slurp(name);
+  printf("%s", s);
+  assert(strcmp(s, "x\ny\na\nb\nC\nd\n") == 0);
+
+  b = stash_patch_load(&patch, name);
+  assert(b);
+  b = stash_patch_apply(&patch, hunk, strlen(hunk), true);
+  assert(b);
+  b = stash_patch_apply(&patch, hunk, strlen(hunk), true);
+  assert(!b);
+  stash_patch_save(&patch);
+  stash_patch_finalize(&patch);
+
+  s = slurp(name);
+  assert(strcmp(s, "x\ny\na\nb\nc\nd\n") == 0);
+  printf("OK\n");
+  remove(name);
+  return 0;
+}
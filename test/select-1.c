@@ -0,0 +1,48 @@
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <stash_select.h>
+
+/** Render the selected hunks as a string of 0s and 1s */
+static const char*
+show(stash_select* S)
+{
+  static char t[64];
+  for (int i = 1; i <= S->count; i++)
+    t[i-1] = stash_select_contains(S, i) ? '1' : '0';
+  t[S->count] = '\0';
+  return t;
+}
+
+static void
+check(const char* spec, const char* expected)
+{
+  stash_select S;
+  bool b = stash_select_parse(&S, spec, 10);
+  assert(b);
+  printf("%-12s %s\n", spec, show(&S));
+  assert(strcmp(show(&S), expected) == 0);
+  stash_select_finalize(&S);
+}
+
+int
+main()
+{
+  check("@",         "1111111111");
+  check("1,3",       "1010000000");
+  check("2-4",       "0111000000");
+  check("8-",        "0000000111");
+  check("^7",        "1111110111");
+  check("1-5,^3",    "1101100000");
+  check("@,^2-9",    "1000000001");
+  check("9-20,99",   "0000000011");
+
+  stash_select S;
+  assert(!stash_select_parse(&S, "x",   10));
+  assert(!stash_select_parse(&S, "1-x", 10));
+  assert(!stash_select_parse(&S, "0",   10));
+
+  printf("OK\n");
+  return 0;
+}
@@ -2,21 +2,157 @@
 set -eu
 
 # TEST 1
+# Push and pop in a working copy made here: .svn/wc.db and
+# the pristine store, as svn makes them, so svn is not needed
 
-TEST=$( readlink --canonicalize $( dirname $0    ) )
-TOP=$(  readlink --canonicalize $( dirname $TEST ) )
-PATH=$TOP/bin:$PATH
 NAME=$( basename $0 )
-cd $TEST/work
 
-stash save t1 -a
-STATUS=$?
-
-if [ $STATUS = 0 ]
+if [ "${HAVE_SQLITE:-no}" != yes ] || ! command -v sqlite3 > /dev/null
 then
-  echo "$NAME: success."
-else
-  echo "$NAME: FAILED"
-  exit 1
+  echo "$NAME: skipped: needs SQLite"
+  exit 77
 fi
 
+WORK=$( mktemp -d ${TMPDIR:-/tmp}/stash-test-1.XXXXXX )
+SERVER=
+trap '[ -n "$SERVER" ] && kill $SERVER; rm -rf $WORK' EXIT
+export XDG_CACHE_HOME=$WORK/cache
+mkdir $WORK/wc
+cd $WORK/wc
+
+fail()
+{
+  echo "$NAME: FAILED: $*"
+  exit 1
+}
+
+DB=.svn/wc.db
+mkdir -p .svn/pristine
+sqlite3 $DB "
+  CREATE TABLE nodes (wc_id INTEGER, local_relpath TEXT,
+    op_depth INTEGER, parent_relpath TEXT, presence TEXT, kind TEXT,
+    checksum TEXT, properties BLOB, changelist TEXT,
+    translated_size INTEGER, last_mod_time INTEGER,
+    PRIMARY KEY (wc_id, local_relpath, op_depth));
+  CREATE TABLE actual_node (wc_id INTEGER, local_relpath TEXT,
+    properties BLOB, changelist TEXT,
+    PRIMARY KEY (wc_id, local_relpath));"
+
+# Make the text of the file its BASE text
+add_base()
+{
+  SHA=$( sha1sum < "$1" | cut -c 1-40 )
+  P=$( echo $SHA | cut -c 1-2 )
+  mkdir -p .svn/pristine/$P
+  cp "$1" .svn/pristine/$P/$SHA.svn-base
+  sqlite3 $DB "INSERT OR REPLACE INTO nodes
+    (wc_id, local_relpath, op_depth, parent_relpath, presence, kind,
+     checksum, translated_size, last_mod_time)
+    VALUES (1, '$1', 0, '', 'normal', 'file', '\$sha1\$$SHA',
+            $( stat -c %s "$1" ), 0);"
+}
+
+# Push one of two hunks, then pop it back
+seq 1 100 > f
+add_base f
+sed -i 's/^10$/ten/;s/^90$/ninety/' f
+cp f f.orig
+stash -q push f 1 || fail "push"
+grep -q '^ten$' f && fail "hunk 1 still in f"
+grep -q '^ninety$' f || fail "hunk 2 not in f"
+stash -q pop f @ || fail "pop"
+cmp -s f f.orig || fail "pop did not restore f"
+
+# The diff cache: a push from an unchanged file does not diff it
+sed -i 's/^10$/ten/' f
+# Else f was written in the second of the push: see below
+touch -d "1 minute ago" f
+cp f f.orig
+# There is no hunk 9: f is unchanged, and its hunks are cached
+stash -q push f 9 || fail "push of no hunks"
+stash -v -v push f 1 > log || fail "push from cache"
+grep -q "diff cache: hunks of" log || fail "no cache hit"
+stash -q pop f @ || fail "pop after cache hit"
+cmp -s f f.orig || fail "pop after cache hit did not restore f"
+
+# An entry is not used if f was written in the second it was
+# stamped: f may have changed again with the same size and mtime
+touch -d "1 hour" stamp
+touch -r stamp f
+stash -q push f 9 || fail "push of no hunks"
+# Rewrite f in place: the same inode
+sed 's/^ten$/TEN/' f > g
+cat g > f
+touch -r stamp f
+stash -v -v push f @ > log || fail "push of a racily clean file"
+grep -q "diff cache: racily clean" log || fail "no racily clean entry"
+grep -q '^+TEN$' f.stash || fail "racily clean hunks were used"
+stash -q pop f @ || fail "pop of a racily clean file"
+sed -i 's/^TEN$/10/' f
+
+# For a large file, only the lines between its unchanged head
+# and tail are diffed again: the hunks must be those of a full diff
+seq 1 200000 > big
+add_base big
+sed -i 's/^1000$/a/;s/^190000$/b/' big
+stash -q push big 9 || fail "push of no hunks"
+sed -i 's/^100000$/c/' big
+cp big big.orig
+stash -v push big @ > log || fail "push with splice"
+grep -q "diff cache: kept" log || fail "no splice"
+grep -v "^## stash push" big.stash > spliced
+stash -q pop big @ || fail "pop after splice"
+cmp -s big big.orig || fail "pop after splice did not restore big"
+rm big.stash*
+XDG_CACHE_HOME=$WORK/nocache stash -q push big @ || fail "full push"
+grep -v "^## stash push" big.stash > full
+cmp -s spliced full || fail "spliced hunks differ from a full diff"
+rm big.stash*
+
+# stash serve: a command sent over the socket runs in the server
+SOCKET=$WORK/stash.sock
+stash serve --socket $SOCKET > serve.log 2>&1 &
+SERVER=$!
+i=0
+while ! [ -S $SOCKET ]
+do
+  i=$(( i+1 ))
+  [ $i -gt 100 ] && fail "server did not start"
+  sleep 0.1
+done
+[ $( stat -c %a $SOCKET ) = 600 ] || fail "socket is not mode 600"
+sed -i 's/^20$/twenty/' f
+cp f f.orig
+stash -v -v --socket $SOCKET push f @ > log || fail "served push"
+grep -q "no server" log && fail "push was not served"
+grep -q '^twenty$' f && fail "served push left the hunk in f"
+stash --socket $SOCKET pop f @ > /dev/null || fail "served pop"
+cmp -s f f.orig || fail "served pop did not restore f"
+kill $SERVER
+wait $SERVER || true
+SERVER=
+[ -S $SOCKET ] && fail "server left its socket"
+
+# stash --batch: one result line per command, quoted arguments
+cp f "my file"
+add_base "my file"
+sed -i 's/^30$/thirty/;s/^70$/seventy/' "my file"
+cp "my file" "my file.orig"
+cat > commands <<EOF
+# Comments and blank lines have no results
+
+push "my file" 2
+pop no-such-file @
+push "my file" 1
+pop "my file" @
+EOF
+stash --batch commands > results 2> /dev/null && fail "batch with a failure"
+TAB=$( printf '\t' )
+[ $( wc -l < results ) = 4 ] || fail "batch results: $( cat results )"
+grep -q "^3${TAB}ok${TAB}\$" results || fail "batch line 3"
+grep -q "^4${TAB}failed${TAB}.*no-such-file" results || fail "batch line 4"
+grep -q "^5${TAB}ok${TAB}\$" results || fail "batch line 5"
+grep -q "^6${TAB}ok${TAB}\$" results || fail "batch line 6"
+cmp -s "my file" "my file.orig" || fail "batch did not restore my file"
+
+echo "$NAME: success."